@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+bool
+arena_init (struct arena *a, size_t size)
+{
+	a->base = malloc (size);
+	if (!a->base)
+		return false;
+
+	a->size = size;
+	a->used = 0;
+
+	return true;
+}
+
+void
+arena_destroy (struct arena *a)
+{
+	free (a->base);
+	a->base = NULL;
+	a->size = a->used = 0;
+}
+
+void *
+arena_alloc (struct arena *a, size_t size)
+{
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (size > a->size - a->used)
+		return NULL;
+
+	p = a->base + a->used;
+	a->used += size;
+	memset (p, 0, size);
+
+	return p;
+}
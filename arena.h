@@ -0,0 +1,35 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bump allocator over one block. Allocations are only given back all
+ * at once, by rewinding to a mark taken earlier, so reallocating the
+ * last thing allocated never touches the heap.
+ */
+struct arena {
+	unsigned char *base;
+	size_t size, used;
+};
+
+bool arena_init (struct arena *a, size_t size);
+void arena_destroy (struct arena *a);
+
+/* zeroed, like calloc */
+void *arena_alloc (struct arena *a, size_t size);
+
+static inline size_t
+arena_mark (const struct arena *a)
+{
+	return a->used;
+}
+
+static inline void
+arena_rewind (struct arena *a, size_t mark)
+{
+	a->used = mark;
+}
+
+#endif
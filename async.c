@@ -0,0 +1,224 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "mfc.h"
+
+/*
+ * Asynchronous mode, for callers with their own event loop. The context
+ * gets an epoll set of its device and of an eventfd, and the caller
+ * only watches that one fd: it turns readable when the device has
+ * buffers to give back, or when something the caller did (queueing,
+ * releasing a frame) needs another look. mfc_ctxt_dispatch () then does
+ * whatever doesn't block and reports through the callbacks.
+ *
+ * The device only stays in the set while it holds buffers: with both
+ * queues empty it would report POLLERR, over and over.
+ */
+
+bool
+mfc_ctxt_async_init (struct mfc_ctxt *ctxt,
+		     const struct vjmfc_callbacks *callbacks)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+
+	if (ctxt->async_fd != -1)
+		return false;
+
+	ctxt->kick_efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctxt->kick_efd < 0) {
+		perror ("Couldn't create eventfd: ");
+		return false;
+	}
+
+	ctxt->async_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (ctxt->async_fd < 0) {
+		perror ("Couldn't create epoll: ");
+		return false;
+	}
+
+	ev.data.fd = ctxt->kick_efd;
+	if (epoll_ctl (ctxt->async_fd, EPOLL_CTL_ADD, ctxt->kick_efd, &ev) != 0) {
+		perror ("Couldn't add eventfd to epoll: ");
+		return false;
+	}
+
+	ctxt->callbacks = *callbacks;
+
+	/* the free input buffers are news too */
+	mfc_ctxt_kick (ctxt);
+	return true;
+}
+
+void
+mfc_ctxt_kick (struct mfc_ctxt *ctxt)
+{
+	uint64_t one = 1;
+
+	if (ctxt->kick_efd == -1)
+		return;
+
+	if (write (ctxt->kick_efd, &one, sizeof (one)) != sizeof (one))
+		perror ("Couldn't kick the context: ");
+}
+
+static bool
+update_watch (struct mfc_ctxt *ctxt)
+{
+	bool want = !ctxt->done &&
+		(ctxt->out_queued > 0 || ctxt->nfree < ctxt->ic);
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLPRI,
+		.data.fd = ctxt->handler,
+	};
+
+	if (want == ctxt->watching)
+		return true;
+
+	if (epoll_ctl (ctxt->async_fd,
+		       want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		       ctxt->handler,
+		       &ev) != 0) {
+		perror ("Couldn't watch the device: ");
+		return false;
+	}
+
+	ctxt->watching = want;
+	return true;
+}
+
+/*
+ * The header went in without waiting, set up CAPTURE once it's parsed.
+ * Without events G_FMT would block until then, so it's only asked for
+ * once an OUTPUT buffer is back: the driver returns them after parsing.
+ * The device stays watched meanwhile, it holds the header.
+ */
+static bool
+header_parsed (struct mfc_ctxt *ctxt, int revents)
+{
+	struct v4l2_event ev;
+
+	if (ctxt->events) {
+		if (!(revents & POLLPRI))
+			return true;
+
+		while (v4l2_mfc_dqevent (ctxt->handler, &ev) == 0)
+			;
+
+		return mfc_ctxt_setup_capture (ctxt);
+	}
+
+	if (revents & POLLOUT)
+		ctxt->header_returned = true;
+
+	if (ctxt->header_returned &&
+	    v4l2_mfc_g_fmt (ctxt->handler, &ctxt->fmt) == 0)
+		return mfc_ctxt_setup_capture (ctxt);
+
+	if (now_ns () > ctxt->header_deadline) {
+		fprintf (stderr, "Timeout waiting for the header to be parsed\n");
+		return false;
+	}
+
+	/* nothing else will wake the caller up to try again */
+	if (ctxt->header_returned)
+		mfc_ctxt_kick (ctxt);
+	return true;
+}
+
+static bool
+dispatch_frames (struct mfc_ctxt *ctxt)
+{
+	int ret;
+	uint32_t idx;
+	struct vjmfc_frame frame;
+	const struct vjmfc_callbacks *cb = &ctxt->callbacks;
+
+	while ((ret = mfc_ctxt_dequeue_frame (ctxt, &idx)) > 0) {
+		ctxt->frames++;
+
+		/* nobody to give it to */
+		if (!cb->frame_ready) {
+			if (!mfc_ctxt_queue_frame (ctxt, idx))
+				return false;
+			continue;
+		}
+
+		mfc_ctxt_get_frame (ctxt, idx, &frame);
+		cb->frame_ready (&frame, cb->data);
+	}
+
+	return ret == 0;
+}
+
+bool
+mfc_ctxt_dispatch (struct mfc_ctxt *ctxt)
+{
+	int revents = 0;
+	uint64_t cnt;
+	const struct vjmfc_callbacks *cb = &ctxt->callbacks;
+
+	(void) !read (ctxt->kick_efd, &cnt, sizeof (cnt));
+
+	if (ctxt->watching &&
+	    v4l2_mfc_poll (ctxt->handler,
+			   POLLIN | POLLOUT | POLLPRI,
+			   &revents,
+			   0) < 0 && errno != EINTR) {
+		perror ("Couldn't poll the device: ");
+		return false;
+	}
+
+	if (revents & POLLERR) {
+		fprintf (stderr, "Device reported an error\n");
+		return false;
+	}
+
+	if (!ctxt->capture_ready && ctxt->header_queued) {
+		if (!header_parsed (ctxt, revents))
+			return false;
+	} else if (revents & POLLPRI && !mfc_ctxt_handle_events (ctxt)) {
+		return false;
+	}
+
+	if (revents & POLLOUT && !mfc_ctxt_dequeue_input (ctxt))
+		return false;
+
+	/* file-backed contexts feed themselves */
+	if (mfc_ctxt_has_file (ctxt) && ctxt->capture_ready &&
+	    !mfc_ctxt_feed (ctxt))
+		return false;
+
+	if (revents & POLLIN && !dispatch_frames (ctxt))
+		return false;
+
+	if (!mfc_ctxt_has_file (ctxt) && !ctxt->eos && ctxt->nfree > 0 &&
+	    cb->input_free)
+		cb->input_free (cb->data);
+
+	if (ctxt->done && !ctxt->drained) {
+		ctxt->drained = true;
+		if (cb->drained)
+			cb->drained (cb->data);
+	}
+
+	return update_watch (ctxt);
+}
+
+void
+mfc_ctxt_async_close (struct mfc_ctxt *ctxt)
+{
+	if (ctxt->async_fd != -1)
+		close (ctxt->async_fd);
+	if (ctxt->kick_efd != -1)
+		close (ctxt->kick_efd);
+	ctxt->async_fd = -1;
+	ctxt->kick_efd = -1;
+	ctxt->watching = false;
+}
@@ -1,10 +1,12 @@
 #include <libavcodec/avcodec.h>
 #include <linux/videodev2.h>
+#include <math.h>
 
 #include "av.h"
 
+/* the container header only, streams may still lack their details */
 AVFormatContext *
-av_context_new (const char *fname)
+av_context_open (const char *fname)
 {
 	AVFormatContext *ic = NULL;
 
@@ -13,22 +15,24 @@ av_context_new (const char *fname)
 	if (avformat_open_input (&ic, fname, NULL, NULL) < 0)
 		return NULL;
 
-	if (avformat_find_stream_info (ic, NULL) < 0) {
-		avformat_close_input (&ic);
-		return NULL;
-	}
-
 	return ic;
 }
 
+/* the slow part: read ahead until every stream is known */
+bool
+av_context_probe (AVFormatContext *ic)
+{
+	return avformat_find_stream_info (ic, NULL) >= 0;
+}
+
 void
 av_context_free (AVFormatContext **fctxt)
 {
 	avformat_close_input (fctxt);
 }
 
-static AVCodecContext *
-get_video_codec_ctxt (AVFormatContext *ic)
+static AVStream *
+get_video_stream (AVFormatContext *ic)
 {
 	unsigned int i;
 	AVCodecContext *cc;
@@ -36,12 +40,19 @@ get_video_codec_ctxt (AVFormatContext *ic)
 	for (i = 0; i < ic->nb_streams; i++) {
 		cc = ic->streams[i]->codec;
 		if (cc->codec_type == AVMEDIA_TYPE_VIDEO)
-			return cc;
+			return ic->streams[i];
         }
 
 	return NULL;
 }
 
+static AVCodecContext *
+get_video_codec_ctxt (AVFormatContext *ic)
+{
+	AVStream *st = get_video_stream (ic);
+	return st ? st->codec : NULL;
+}
+
 uint32_t
 get_codec_id (AVFormatContext *ic)
 {
@@ -75,7 +86,69 @@ uint8_t *
 get_codec_extradata (AVFormatContext *ic, int *size)
 {
 	AVCodecContext *cc = get_video_codec_ctxt(ic);
+
 	if (size)
-		*size = cc->extradata_size;
-	return cc->extradata;
+		*size = cc ? cc->extradata_size : 0;
+	return cc ? cc->extradata : NULL;
+}
+
+/* average bytes per frame from the bitrate, 0 when unknown */
+uint32_t
+get_frame_size (AVFormatContext *ic)
+{
+	int64_t rate;
+	AVStream *st = get_video_stream (ic);
+
+	if (!st || st->avg_frame_rate.num <= 0 || st->avg_frame_rate.den <= 0)
+		return 0;
+
+	rate = (st->codec->bit_rate > 0) ? st->codec->bit_rate : ic->bit_rate;
+	if (rate <= 0)
+		return 0;
+
+	return rate / 8 * st->avg_frame_rate.den / st->avg_frame_rate.num;
+}
+
+int
+av_read_video_packet (AVFormatContext *ic, AVPacket *pkt)
+{
+	int ret;
+	AVStream *st = get_video_stream (ic);
+
+	if (!st)
+		return AVERROR_EOF;
+
+	/* skip everything that doesn't belong to the video stream */
+	while ((ret = av_read_frame (ic, pkt)) >= 0) {
+		if (pkt->stream_index == st->index)
+			break;
+		av_packet_unref (pkt);
+	}
+
+	return ret;
+}
+
+/* the packet's timestamp in seconds, NAN without one */
+double
+get_packet_time (AVFormatContext *ic, const AVPacket *pkt)
+{
+	int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+	AVStream *st = get_video_stream (ic);
+
+	if (!st || ts == AV_NOPTS_VALUE || st->time_base.den == 0)
+		return NAN;
+
+	return (double) ts * st->time_base.num / st->time_base.den;
+}
+
+/* seek the video stream to the keyframe at or before pts */
+int
+av_seek_video (AVFormatContext *ic, int64_t pts)
+{
+	AVStream *st = get_video_stream (ic);
+
+	if (!st)
+		return AVERROR (EINVAL);
+
+	return av_seek_frame (ic, st->index, pts, AVSEEK_FLAG_BACKWARD);
 }
@@ -2,13 +2,19 @@
 #define AV_H_
 
 #include <libavformat/avformat.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-AVFormatContext *av_context_new (const char *fname);
+AVFormatContext *av_context_open (const char *fname);
+bool av_context_probe (AVFormatContext *ic);
 void av_context_free (AVFormatContext **fctxt);
 
 
 uint32_t get_codec_id (AVFormatContext *ic);
 uint8_t *get_codec_extradata (AVFormatContext *ic, int *size);
+uint32_t get_frame_size (AVFormatContext *ic);
+int av_read_video_packet (AVFormatContext *ic, AVPacket *pkt);
+int av_seek_video (AVFormatContext *ic, int64_t pts);
+double get_packet_time (AVFormatContext *ic, const AVPacket *pkt);
 
 #endif
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+static double
+clock_now (clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime (id, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+bench_start (struct bench *b, const char *name, enum bench_format format)
+{
+	memset (b, 0, sizeof (*b));
+	b->name = name;
+	b->format = format;
+	b->start = clock_now (CLOCK_MONOTONIC);
+	b->cpu_start = clock_now (CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void
+bench_frame (const struct vjmfc_frame *frame, void *data)
+{
+	struct bench *b = data;
+	uint64_t *latency;
+	uint32_t size;
+
+	if (b->sink)
+		sink_frame (frame, b->sink);
+
+	b->frames++;
+	if (b->samples == b->size) {
+		size = b->size ? b->size * 2 : 1024;
+		latency = realloc (b->latency, size * sizeof (uint64_t));
+		if (!latency) {
+			/* keep counting, just without the sample */
+			b->unsampled++;
+			return;
+		}
+		b->latency = latency;
+		b->size = size;
+	}
+
+	b->latency[b->samples++] = frame->latency;
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank, in ms */
+static double
+percentile (const uint64_t *v, uint32_t n, unsigned int p)
+{
+	uint32_t rank;
+
+	if (n == 0)
+		return 0.0;
+
+	rank = ((uint64_t) n * p + 99) / 100;
+	return v[rank ? rank - 1 : 0] / 1e6;
+}
+
+void
+bench_report (struct bench *b, struct vjmfc *dec)
+{
+	double elapsed, cpu, fps, cpu_ms, p50, p95, p99;
+	uint32_t n = b->samples;
+	char codec[5];
+	struct vjmfc_stats stats;
+
+	elapsed = clock_now (CLOCK_MONOTONIC) - b->start;
+	cpu = clock_now (CLOCK_PROCESS_CPUTIME_ID) - b->cpu_start;
+	vjmfc_get_stats (dec, &stats);
+
+	qsort (b->latency, n, sizeof (uint64_t), cmp_u64);
+	p50 = percentile (b->latency, n, 50);
+	p95 = percentile (b->latency, n, 95);
+	p99 = percentile (b->latency, n, 99);
+
+	fps = elapsed > 0 ? b->frames / elapsed : 0.0;
+	cpu_ms = b->frames ? cpu * 1e3 / b->frames : 0.0;
+
+	memcpy (codec, &stats.fourcc, 4);
+	codec[4] = '\0';
+
+	switch (b->format) {
+	case BENCH_CSV:
+		printf ("%s,%s,%u,%u,%u,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f\n",
+			b->name, codec, stats.width, stats.height, b->frames,
+			fps, p50, p95, p99, stats.output_depth,
+			stats.capture_depth, cpu_ms);
+		break;
+	case BENCH_JSON:
+		printf ("{\"file\": \"%s\", \"codec\": \"%s\", "
+			"\"width\": %u, \"height\": %u, \"frames\": %u, "
+			"\"fps\": %.1f, \"p50_ms\": %.2f, \"p95_ms\": %.2f, "
+			"\"p99_ms\": %.2f, \"output_depth\": %.2f, "
+			"\"capture_depth\": %.2f, \"cpu_ms\": %.3f}\n",
+			b->name, codec, stats.width, stats.height, b->frames,
+			fps, p50, p95, p99, stats.output_depth,
+			stats.capture_depth, cpu_ms);
+		break;
+	default:
+		printf ("> %s: %s %ux%u on %s\n", b->name, codec,
+			stats.width, stats.height,
+			stats.device ? stats.device : "?");
+		printf ("> frames:         %u\n", b->frames);
+		printf ("> fps:            %.1f\n", fps);
+		printf ("> latency (ms):   p50 %.2f  p95 %.2f  p99 %.2f\n",
+			p50, p95, p99);
+		if (b->unsampled > 0)
+			printf ("> unsampled:      %u frames, out of memory\n",
+				b->unsampled);
+		printf ("> queue depth:    OUTPUT %.2f  CAPTURE %.2f\n",
+			stats.output_depth, stats.capture_depth);
+		printf ("> frame buffers:  %u, saturated %.0f%%\n",
+			stats.capture_buffers, stats.saturation * 100);
+		if (stats.read_stalls > 0)
+			printf ("> read stalls:    %llu\n",
+				(unsigned long long) stats.read_stalls);
+		printf ("> cpu per frame:  %.3f ms\n", cpu_ms);
+		break;
+	}
+}
+
+void
+bench_free (struct bench *b)
+{
+	free (b->latency);
+	b->latency = NULL;
+}
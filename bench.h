@@ -0,0 +1,34 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#include "vjmfc.h"
+#include "sink.h"
+
+enum bench_format {
+	BENCH_TEXT,
+	/*
+	 * one line without header: file,codec,width,height,frames,fps,
+	 * p50_ms,p95_ms,p99_ms,output_depth,capture_depth,cpu_ms
+	 */
+	BENCH_CSV,
+	BENCH_JSON,	/* one object with the same fields */
+};
+
+struct bench {
+	enum bench_format format;
+	const char *name;
+	uint64_t *latency;	/* ns, one per sampled frame */
+	uint32_t frames, samples, size;
+	uint32_t unsampled;	/* frames the samples had no room for */
+	double start, cpu_start;
+	struct sink *sink;	/* frames go there too when set */
+};
+
+void bench_start (struct bench *b, const char *name, enum bench_format format);
+void bench_frame (const struct vjmfc_frame *frame, void *data);
+void bench_report (struct bench *b, struct vjmfc *dec);
+void bench_free (struct bench *b);
+
+#endif
@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# Decode every clip in $VIDEOS with each preset and write the results to
+# $RESULTS.csv and $RESULTS.json. The directory should hold a clip per
+# codec (H264, MPG4, H263, MPG1, MPG2) at the resolutions of interest.
+#
+# If $BASELINE exists, fail when the fps of any run drops more than
+# $THRESHOLD percent below it. "./bench.sh update" stores the results
+# as the new baseline.
+#
+# A clip with a <clip>.crc next to it (one "pts crc32c" line per frame,
+# as written by --checksums) must decode to exactly those frames.
+# "./bench.sh update" writes the missing ones.
+
+VIDEOS=${VIDEOS:-../mymfc}
+PRESETS=${PRESETS:-latency default throughput}
+THRESHOLD=${THRESHOLD:-10}
+BASELINE=${BASELINE:-bench-baseline.csv}
+RESULTS=${RESULTS:-bench-results}
+VJMFC=${VJMFC:-./vjmfc}
+
+header=preset,file,codec,width,height,frames,fps,p50_ms,p95_ms,p99_ms,output_depth,capture_depth,cpu_ms
+codecs=( H264 MPG4 H263 MPG1 MPG2 )
+failed=0
+
+echo $header > $RESULTS.csv
+for video in "$VIDEOS"/*; do
+    [ -f "$video" ] || continue
+    case "$video" in *.crc) continue ;; esac
+    for preset in $PRESETS; do
+        # the library logs to stdout with a "> " prefix
+        row=$($VJMFC --bench=csv --preset=$preset \
+            --checksums=$RESULTS.crc "$video" | grep -v '^>')
+        if [ -z "$row" ]; then
+            echo "$video ($preset): decoding failed" >&2
+            failed=1
+            continue
+        fi
+        echo $preset,$row >> $RESULTS.csv
+
+        if [ -f "$video.crc" ]; then
+            if ! cmp -s "$video.crc" $RESULTS.crc; then
+                echo "FAIL $video ($preset): frames differ from $video.crc"
+                failed=1
+            fi
+        elif [ "$1" = update ]; then
+            cp $RESULTS.crc "$video.crc"
+            echo "checksums stored in $video.crc"
+        fi
+    done
+done
+rm -f $RESULTS.crc
+
+awk -F, 'NR == 1 { split ($0, keys); next }
+    { printf "%s{", (NR > 2 ? ",\n" : "[\n");
+      for (i = 1; i <= NF; i++)
+          printf "%s\"%s\": %s", (i > 1 ? ", " : ""), keys[i],
+              ($i ~ /^[0-9.]+$/ ? $i : "\"" $i "\"");
+      printf "}" }
+    END { print (NR > 1 ? "\n]" : "[]") }' $RESULTS.csv > $RESULTS.json
+
+for codec in "${codecs[@]}"; do
+    cut -d, -f3 $RESULTS.csv | grep -qx $codec ||
+        echo "warning: no $codec clip in $VIDEOS" >&2
+done
+
+if [ "$1" = update ]; then
+    cp $RESULTS.csv $BASELINE
+    echo "baseline stored in $BASELINE"
+    exit $failed
+fi
+
+if [ ! -f "$BASELINE" ]; then
+    echo "no $BASELINE, skipping the comparison"
+    exit $failed
+fi
+
+# key on preset and file, compare the fps column
+awk -F, -v threshold=$THRESHOLD '
+    FNR == 1 { next }
+    NR == FNR { base[$1 "," $2] = $7; next }
+    ($1 "," $2) in base {
+        min = base[$1 "," $2] * (1 - threshold / 100)
+        status = $7 < min ? "FAIL" : "ok"
+        printf "%-4s %s (%s): %.1f fps, baseline %.1f\n", status, $2, $1,
+            $7, base[$1 "," $2]
+        if ($7 < min)
+            bad = 1
+    }
+    END { exit bad }' $BASELINE $RESULTS.csv || failed=1
+
+exit $failed
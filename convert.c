@@ -0,0 +1,388 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "convert.h"
+
+/*
+ * NV12MT stores both planes as 64x32 tiles of linear rows. Tiles go in
+ * pairs of rows, zig-zagging through 2x2 groups as in a flipped Z; a
+ * lone last row of tiles is plain left to right. Every row of a tile is
+ * 64 contiguous bytes, so everything below works on 64 byte chunks
+ * wherever they come from.
+ */
+#define TILE_W 64
+#define TILE_H 32
+#define TILE_SIZE (TILE_W * TILE_H)
+
+/* stripes start on chroma tile rows, 64 luma lines */
+#define STRIPE_ALIGN (2 * TILE_H)
+#define MAX_STRIPES 4
+#define STRIPE_MIN_HEIGHT 1080
+
+struct plane {
+	const uint8_t *data;
+	uint32_t width, height;
+	uint32_t x_tiles, y_tiles;	/* 0 for linear planes */
+};
+
+struct stripe {
+	const struct plane *luma, *chroma;
+	const struct vjmfc_image *image;
+	uint32_t y0, y1;
+};
+
+static inline uint32_t
+align (uint32_t v, uint32_t a)
+{
+	return (v + a - 1) & ~(a - 1);
+}
+
+static inline size_t
+tile_index (uint32_t x, uint32_t y, uint32_t x_tiles, uint32_t y_tiles)
+{
+	size_t pos = x + (size_t) (y & ~1) * x_tiles;
+
+	if (y & 1)
+		pos += (x & ~3) + 2;
+	else if ((y_tiles & 1) == 0 || y != y_tiles - 1)
+		pos += (x + 2) & ~3;
+
+	return pos;
+}
+
+static void
+plane_init (struct plane *p,
+	    const void *data,
+	    uint32_t width,
+	    uint32_t height,
+	    bool tiled)
+{
+	p->data = data;
+	p->width = width;
+	p->height = height;
+	p->x_tiles = tiled ? align (width, 2 * TILE_W) / TILE_W : 0;
+	p->y_tiles = tiled ? align (height, TILE_H) / TILE_H : 0;
+}
+
+/* line y from byte x on, up to the end of its tile */
+static inline const uint8_t *
+chunk (const struct plane *p, uint32_t y, uint32_t x)
+{
+	size_t tile;
+
+	if (p->x_tiles == 0)
+		return p->data + (size_t) y * p->width + x;
+
+	tile = tile_index (x / TILE_W, y / TILE_H, p->x_tiles, p->y_tiles);
+	return p->data + tile * TILE_SIZE + (y % TILE_H) * TILE_W + x % TILE_W;
+}
+
+static inline void
+copy_chunk (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+#if HAVE_NEON
+	if (n == TILE_W) {
+		uint8x16_t a = vld1q_u8 (src);
+		uint8x16_t b = vld1q_u8 (src + 16);
+		uint8x16_t c = vld1q_u8 (src + 32);
+		uint8x16_t d = vld1q_u8 (src + 48);
+		vst1q_u8 (dst, a);
+		vst1q_u8 (dst + 16, b);
+		vst1q_u8 (dst + 32, c);
+		vst1q_u8 (dst + 48, d);
+		return;
+	}
+#elif HAVE_SSE2
+	if (n == TILE_W) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *) src);
+		__m128i b = _mm_loadu_si128 ((const __m128i *) (src + 16));
+		__m128i c = _mm_loadu_si128 ((const __m128i *) (src + 32));
+		__m128i d = _mm_loadu_si128 ((const __m128i *) (src + 48));
+		_mm_storeu_si128 ((__m128i *) dst, a);
+		_mm_storeu_si128 ((__m128i *) (dst + 16), b);
+		_mm_storeu_si128 ((__m128i *) (dst + 32), c);
+		_mm_storeu_si128 ((__m128i *) (dst + 48), d);
+		return;
+	}
+#endif
+	memcpy (dst, src, n);
+}
+
+/* interleaved UV bytes to separate U and V */
+static inline void
+split_chunk (uint8_t *u, uint8_t *v, const uint8_t *src, uint32_t n)
+{
+	uint32_t i = 0;
+
+#if HAVE_NEON
+	for (; i + 32 <= n; i += 32) {
+		uint8x16x2_t c = vld2q_u8 (src + i);
+		vst1q_u8 (u + i / 2, c.val[0]);
+		vst1q_u8 (v + i / 2, c.val[1]);
+	}
+#elif HAVE_SSE2
+	const __m128i mask = _mm_set1_epi16 (0x00ff);
+
+	for (; i + 32 <= n; i += 32) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (src + i));
+		__m128i b = _mm_loadu_si128 ((const __m128i *) (src + i + 16));
+		_mm_storeu_si128 ((__m128i *) (u + i / 2),
+				  _mm_packus_epi16 (_mm_and_si128 (a, mask),
+						    _mm_and_si128 (b, mask)));
+		_mm_storeu_si128 ((__m128i *) (v + i / 2),
+				  _mm_packus_epi16 (_mm_srli_epi16 (a, 8),
+						    _mm_srli_epi16 (b, 8)));
+	}
+#endif
+	for (; i + 1 < n; i += 2) {
+		u[i / 2] = src[i];
+		v[i / 2] = src[i + 1];
+	}
+}
+
+/*
+ * BT.601 limited range in 6 bit fixed point:
+ * R = 1.164 (Y - 16) + 1.596 (V - 128)
+ * G = 1.164 (Y - 16) - 0.391 (U - 128) - 0.813 (V - 128)
+ * B = 1.164 (Y - 16) + 2.018 (U - 128)
+ */
+#define CY 74
+#define CRV 102
+#define CGU 25
+#define CGV 52
+#define CBU 129
+
+static inline uint8_t
+clamp8 (int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+#if HAVE_NEON
+static inline void
+rgb_16 (uint8_t *rgb, const uint8_t *y, const uint8_t *uv)
+{
+	int h;
+	uint8x8_t r[2], g[2], b[2];
+	uint8x8x2_t c = vld2_u8 (uv);
+	uint8x8x2_t u = vzip_u8 (c.val[0], c.val[0]);
+	uint8x8x2_t v = vzip_u8 (c.val[1], c.val[1]);
+	uint8x16_t yy = vld1q_u8 (y);
+	uint8x16x3_t out;
+
+	for (h = 0; h < 2; h++) {
+		uint8x8_t yh = h ? vget_high_u8 (yy) : vget_low_u8 (yy);
+		int16x8_t ys = vmulq_n_s16 (vreinterpretq_s16_u16 (
+			vsubl_u8 (yh, vdup_n_u8 (16))), CY);
+		int16x8_t us = vreinterpretq_s16_u16 (
+			vsubl_u8 (u.val[h], vdup_n_u8 (128)));
+		int16x8_t vs = vreinterpretq_s16_u16 (
+			vsubl_u8 (v.val[h], vdup_n_u8 (128)));
+
+		r[h] = vqrshrun_n_s16 (vqaddq_s16 (ys, vmulq_n_s16 (vs, CRV)), 6);
+		g[h] = vqrshrun_n_s16 (vqsubq_s16 (vqsubq_s16 (ys,
+			vmulq_n_s16 (us, CGU)), vmulq_n_s16 (vs, CGV)), 6);
+		b[h] = vqrshrun_n_s16 (vqaddq_s16 (ys, vmulq_n_s16 (us, CBU)), 6);
+	}
+
+	out.val[0] = vcombine_u8 (r[0], r[1]);
+	out.val[1] = vcombine_u8 (g[0], g[1]);
+	out.val[2] = vcombine_u8 (b[0], b[1]);
+	vst3q_u8 (rgb, out);
+}
+#endif
+
+static inline void
+rgb_chunk (uint8_t *rgb, const uint8_t *y, const uint8_t *uv, uint32_t n)
+{
+	uint32_t i = 0;
+	int l, u, v;
+
+#if HAVE_NEON
+	for (; i + 16 <= n; i += 16)
+		rgb_16 (rgb + 3 * i, y + i, uv + i);
+#endif
+	for (; i < n; i++) {
+		l = (y[i] - 16) * CY;
+		u = uv[i & ~1] - 128;
+		v = uv[i | 1] - 128;
+
+		rgb[3 * i] = clamp8 ((l + CRV * v + 32) >> 6);
+		rgb[3 * i + 1] = clamp8 ((l - CGU * u - CGV * v + 32) >> 6);
+		rgb[3 * i + 2] = clamp8 ((l + CBU * u + 32) >> 6);
+	}
+}
+
+static void
+copy_plane (const struct plane *p,
+	    uint8_t *dst,
+	    uint32_t stride,
+	    uint32_t y0,
+	    uint32_t y1)
+{
+	uint32_t x, y, n;
+
+	for (y = y0; y < y1; y++) {
+		for (x = 0; x < p->width; x += n) {
+			n = p->width - x < TILE_W ? p->width - x : TILE_W;
+			copy_chunk (dst + (size_t) y * stride + x,
+				    chunk (p, y, x), n);
+		}
+	}
+}
+
+static void
+split_plane (const struct plane *p,
+	     const struct vjmfc_image *image,
+	     uint32_t y0,
+	     uint32_t y1)
+{
+	uint32_t x, y, n;
+
+	for (y = y0; y < y1; y++) {
+		uint8_t *u = image->plane[1] + (size_t) y * image->stride[1];
+		uint8_t *v = image->plane[2] + (size_t) y * image->stride[2];
+
+		for (x = 0; x < p->width; x += n) {
+			n = p->width - x < TILE_W ? p->width - x : TILE_W;
+			split_chunk (u + x / 2, v + x / 2, chunk (p, y, x), n);
+		}
+	}
+}
+
+static void
+rgb_rows (const struct stripe *s)
+{
+	uint32_t x, y, n, width = s->luma->width;
+
+	for (y = s->y0; y < s->y1; y++) {
+		uint8_t *rgb = s->image->plane[0] +
+			(size_t) y * s->image->stride[0];
+
+		/* a chunk of chroma spans the same pixels as one of luma */
+		for (x = 0; x < width; x += n) {
+			n = width - x < TILE_W ? width - x : TILE_W;
+			rgb_chunk (rgb + 3 * x,
+				   chunk (s->luma, y, x),
+				   chunk (s->chroma, y / 2, x),
+				   n);
+		}
+	}
+}
+
+static void *
+convert_stripe (void *data)
+{
+	const struct stripe *s = data;
+	const struct vjmfc_image *image = s->image;
+	uint32_t c0 = s->y0 / 2, c1 = (s->y1 + 1) / 2;
+
+	switch (image->format) {
+	case VJMFC_PIXFMT_NV12:
+		copy_plane (s->luma, image->plane[0], image->stride[0],
+			    s->y0, s->y1);
+		copy_plane (s->chroma, image->plane[1], image->stride[1],
+			    c0, c1);
+		break;
+	case VJMFC_PIXFMT_I420:
+		copy_plane (s->luma, image->plane[0], image->stride[0],
+			    s->y0, s->y1);
+		split_plane (s->chroma, image, c0, c1);
+		break;
+	case VJMFC_PIXFMT_RGB24:
+		rgb_rows (s);
+		break;
+	}
+
+	return NULL;
+}
+
+static unsigned int
+stripe_count (uint32_t height, unsigned int threads)
+{
+	long cpus;
+
+	if (threads == 0) {
+		if (height < STRIPE_MIN_HEIGHT)
+			return 1;
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	if (threads > MAX_STRIPES)
+		threads = MAX_STRIPES;
+
+	/* no stripe thinner than a chroma tile row */
+	if (threads > align (height, STRIPE_ALIGN) / STRIPE_ALIGN)
+		threads = align (height, STRIPE_ALIGN) / STRIPE_ALIGN;
+
+	return threads ? threads : 1;
+}
+
+int
+convert_frame (const struct vjmfc_frame *frame,
+	       const struct vjmfc_image *image,
+	       unsigned int threads)
+{
+	unsigned int i, n;
+	uint32_t step, width = frame->width, height = frame->height;
+	bool tiled = frame->fourcc == V4L2_PIX_FMT_NV12MT;
+	struct plane luma, chroma;
+	struct stripe stripes[MAX_STRIPES];
+	pthread_t tids[MAX_STRIPES];
+	bool started[MAX_STRIPES];
+
+	if (!tiled && frame->fourcc != V4L2_PIX_FMT_NV12M)
+		return -EINVAL;
+
+	/* exported frames have nothing for the CPU to read */
+	if (frame->num_planes != 2 || !frame->plane[0] || !frame->plane[1])
+		return -EINVAL;
+
+	if ((unsigned) image->format > VJMFC_PIXFMT_RGB24)
+		return -EINVAL;
+
+	plane_init (&luma, frame->plane[0], width, height, tiled);
+	plane_init (&chroma, frame->plane[1], width, (height + 1) / 2, tiled);
+
+	n = stripe_count (height, threads);
+	step = align ((height + n - 1) / n, STRIPE_ALIGN);
+
+	for (i = 0; i < n; i++) {
+		stripes[i] = (struct stripe) {
+			.luma = &luma,
+			.chroma = &chroma,
+			.image = image,
+			.y0 = i * step < height ? i * step : height,
+			.y1 = (i + 1) * step < height ? (i + 1) * step : height,
+		};
+	}
+
+	/* the first stripe is ours, a thread that won't start too */
+	for (i = 1; i < n; i++)
+		started[i] = pthread_create (&tids[i], NULL, convert_stripe,
+					     &stripes[i]) == 0;
+
+	convert_stripe (&stripes[0]);
+
+	for (i = 1; i < n; i++) {
+		if (started[i])
+			pthread_join (tids[i], NULL);
+		else
+			convert_stripe (&stripes[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include "vjmfc.h"
+
+/* see vjmfc_convert_frame () */
+int convert_frame (const struct vjmfc_frame *frame,
+		   const struct vjmfc_image *image,
+		   unsigned int threads);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "counters.h"
+
+#define MAX_SLOTS 64
+
+/* a cache line each, so decoders never share one */
+#define SLOT_SIZE \
+	((sizeof (struct vjmfc_counters) + 63) & ~(size_t) 63)
+
+/* a slot between being taken and being ready */
+#define SLOT_CLAIMING 2
+
+static uint8_t *shm;
+
+static struct vjmfc_counters *
+slot (unsigned int i)
+{
+	return (struct vjmfc_counters *) (shm + SLOT_SIZE * (i + 1));
+}
+
+int
+counters_export (const char *name)
+{
+	int fd;
+	void *p;
+	size_t size = SLOT_SIZE * (MAX_SLOTS + 1);
+	struct vjmfc_counters_header *h;
+
+	if (__atomic_load_n (&shm, __ATOMIC_ACQUIRE))
+		return -EBUSY;
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate (fd, size) != 0) {
+		close (fd);
+		return -errno;
+	}
+
+	p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	h = p;
+	h->version = VJMFC_COUNTERS_VERSION;
+	h->slots = MAX_SLOTS;
+	h->slot_size = SLOT_SIZE;
+	h->pid = getpid ();
+	/* readers check the magic last */
+	__atomic_store_n (&h->magic, VJMFC_COUNTERS_MAGIC, __ATOMIC_RELEASE);
+
+	__atomic_store_n (&shm, p, __ATOMIC_RELEASE);
+	return 0;
+}
+
+struct vjmfc_counters *
+counters_claim (void)
+{
+	unsigned int i;
+	uint32_t expected;
+	struct timespec ts;
+	struct vjmfc_counters *c;
+
+	if (!__atomic_load_n (&shm, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	for (i = 0; i < MAX_SLOTS; i++) {
+		c = slot (i);
+		expected = 0;
+		if (!__atomic_compare_exchange_n (&c->in_use,
+						  &expected,
+						  SLOT_CLAIMING,
+						  false,
+						  __ATOMIC_ACQUIRE,
+						  __ATOMIC_RELAXED))
+			continue;
+
+		/* only counted from here on, nobody reads it yet */
+		memset ((uint8_t *) c + offsetof (struct vjmfc_counters, fourcc),
+			0,
+			sizeof (*c) - offsetof (struct vjmfc_counters, fourcc));
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		c->opened = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+		c->generation++;
+
+		__atomic_store_n (&c->in_use, 1, __ATOMIC_RELEASE);
+		return c;
+	}
+
+	return NULL;
+}
+
+void
+counters_release (struct vjmfc_counters *c)
+{
+	__atomic_store_n (&c->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void
+counters_read (const struct vjmfc_counters *c, struct vjmfc_counters *out)
+{
+	const uint32_t *s32[] = {
+		&c->in_use, &c->generation, &c->fourcc, &c->width,
+		&c->height, &c->output_queued, &c->capture_queued,
+		&c->capture_buffers,
+	};
+	uint32_t *d32[] = {
+		&out->in_use, &out->generation, &out->fourcc, &out->width,
+		&out->height, &out->output_queued, &out->capture_queued,
+		&out->capture_buffers,
+	};
+	const uint64_t *s64[] = {
+		&c->opened, &c->updated, &c->packets, &c->bytes, &c->frames,
+		&c->dropped, &c->eagain, &c->epipe, &c->errors, &c->mapped,
+		&c->resolution_changes,
+	};
+	uint64_t *d64[] = {
+		&out->opened, &out->updated, &out->packets, &out->bytes,
+		&out->frames, &out->dropped, &out->eagain, &out->epipe,
+		&out->errors, &out->mapped, &out->resolution_changes,
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof (s32) / sizeof (s32[0]); i++)
+		*d32[i] = __atomic_load_n (s32[i], __ATOMIC_RELAXED);
+	for (i = 0; i < sizeof (s64) / sizeof (s64[0]); i++)
+		*d64[i] = __atomic_load_n (s64[i], __ATOMIC_RELAXED);
+}
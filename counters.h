@@ -0,0 +1,39 @@
+#ifndef COUNTERS_H_
+#define COUNTERS_H_
+
+#include <stdint.h>
+
+#include "vjmfc.h"
+
+/*
+ * Every counter is bumped with a relaxed atomic: no lock and no
+ * ordering, only no torn values for the readers. Decoders without an
+ * exported slot count into one of their own.
+ */
+static inline void
+counter_add (uint64_t *c, uint64_t n)
+{
+	__atomic_fetch_add (c, n, __ATOMIC_RELAXED);
+}
+
+static inline void
+counter_set (uint32_t *c, uint32_t v)
+{
+	__atomic_store_n (c, v, __ATOMIC_RELAXED);
+}
+
+static inline void
+counter_set64 (uint64_t *c, uint64_t v)
+{
+	__atomic_store_n (c, v, __ATOMIC_RELAXED);
+}
+
+int counters_export (const char *name);
+
+/* a free exported slot, NULL without an export or when all are taken */
+struct vjmfc_counters *counters_claim (void);
+void counters_release (struct vjmfc_counters *c);
+
+void counters_read (const struct vjmfc_counters *c, struct vjmfc_counters *out);
+
+#endif
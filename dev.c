@@ -5,12 +5,56 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "dev.h"
 #include "v4l2_mfc.h"
 
+/*
+ * Device paths are looked up once per driver name and kept, in memory
+ * and in $XDG_RUNTIME_DIR/vjmfc.devices for the next process. A cached
+ * path is trusted only if its sysfs name still matches, which costs one
+ * read instead of a walk over every video node.
+ *
+ * A driver may have several nodes (several codec instances, or more
+ * than one decoder on the box), and each new handle goes to the least
+ * loaded one: the fewest open handles, then the best frame rate its
+ * last streams got. Next to each node lives a pool of warm handles:
+ * opened and queried, ready for a new context.
+ */
+
+#define MAX_DRIVERS 4
+#define MAX_NODES 8
+#define NAME_LEN 32
+#define PATH_LEN 64
+
+/* each handle holds one of the MFC's hardware instances */
+#define MAX_WARM 16
+
+/* weight of the newest stream in a node's frame rate */
+#define FPS_WEIGHT 0.25
+
+#define CACHE_FILE "vjmfc.devices"
+
+struct dev_entry {
+	char name[NAME_LEN];
+	char path[PATH_LEN];
+	int warm[MAX_WARM];
+	unsigned int nwarm, target;
+
+	/* handles given out and not released, and what streams got */
+	unsigned int active;
+	double fps;
+};
+
+static struct dev_entry entries[MAX_NODES];
+static unsigned int nentries;
+static char probed[MAX_DRIVERS][NAME_LEN];
+static unsigned int nprobed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 static char *
-get_driver (char *fname)
+get_driver (const char *fname)
 {
 	FILE *fp;
 	char path[BUFSIZ];
@@ -27,6 +71,7 @@ get_driver (char *fname)
 		return NULL;
 
 	s = getline (&driver, &n, fp);
+	fclose (fp);
 	if (s < 0) {
 		free (driver);
 		return NULL;
@@ -39,59 +84,359 @@ get_driver (char *fname)
 	return driver;
 }
 
-static char *
-get_device (const char *fname)
+static bool
+get_device (const char *fname, char *device, size_t size)
 {
 	char path[BUFSIZ], target[BUFSIZ];
 	int s, ret;
-	char *bname, *device;
 
-	errno = 0;
 	snprintf (path, BUFSIZ, "/sys/class/video4linux/%s", fname);
 	ret = readlink (path, target, BUFSIZ);
-	if (ret < 0 || ret == BUFSIZ || errno)
-		return NULL;
-	target[ret] = '\0'; /* why do we need this? */
+	if (ret < 0 || ret == BUFSIZ)
+		return false;
+	target[ret] = '\0'; /* readlink doesn't terminate it */
 
-	bname = basename (target);
-	device = (char *) malloc (1024 * sizeof (char));
-	s = snprintf (device, 1024, "/dev/%s", bname);
-	if (s >= 1024)
-		return NULL;
+	s = snprintf (device, size, "/dev/%s", basename (target));
+	return s < (int) size;
+}
 
-	return device;
+static bool
+driver_matches (const char *fname, const char *drivername)
+{
+	bool match;
+	char *driver = get_driver (fname);
+
+	if (!driver)
+		return false;
+
+	match = strstr (driver, drivername) != NULL;
+	free (driver);
+
+	return match;
 }
 
-char *
-v4l2_find_device (const char *drivername)
+/* with the lock held */
+static bool
+add_node (const char *drivername, const char *device)
+{
+	unsigned int i;
+	struct dev_entry *e;
+
+	for (i = 0; i < nentries; i++) {
+		if (strcmp (entries[i].path, device) == 0)
+			return true;
+	}
+
+	if (nentries == MAX_NODES)
+		return false;
+
+	e = &entries[nentries++];
+	memset (e, 0, sizeof (*e));
+	snprintf (e->name, NAME_LEN, "%s", drivername);
+	snprintf (e->path, PATH_LEN, "%s", device);
+
+	return true;
+}
+
+/* with the lock held */
+static bool
+scan_devices (const char *drivername)
 {
 	DIR *dir;
 	struct dirent *ent;
-	char *driver, *device;
+	char device[PATH_LEN];
+	bool found = false;
 
 	dir = opendir ("/sys/class/video4linux/");
 	if (!dir)
-		return NULL;
+		return false;
 
-	device = NULL;
 	while ((ent = readdir (dir)) != NULL) {
 		if (strncmp (ent->d_name, "video", 5) != 0)
 			continue;
 
-		driver = get_driver (ent->d_name);
-		if (!driver)
+		if (driver_matches (ent->d_name, drivername) &&
+		    get_device (ent->d_name, device, sizeof (device)) &&
+		    add_node (drivername, device))
+			found = true;
+	}
+
+	closedir (dir);
+
+	return found;
+}
+
+static bool
+cache_path (char *path, size_t size)
+{
+	const char *dir = getenv ("XDG_RUNTIME_DIR");
+
+	if (!dir || !*dir)
+		return false;
+
+	return snprintf (path, size, "%s/%s", dir, CACHE_FILE) < (int) size;
+}
+
+/*
+ * "driver path" lines, one per node; the node under /dev has the name
+ * sysfs uses. One stale line and the whole driver is scanned again.
+ * With the lock held.
+ */
+static bool
+load_cached (const char *drivername)
+{
+	FILE *fp;
+	char path[BUFSIZ], name[NAME_LEN], dev[PATH_LEN];
+	unsigned int first = nentries;
+	bool found = false, stale = false;
+
+	if (!cache_path (path, sizeof (path)))
+		return false;
+
+	fp = fopen (path, "r");
+	if (!fp)
+		return false;
+
+	while (!stale && fscanf (fp, "%31s %63s", name, dev) == 2) {
+		if (strcmp (name, drivername) != 0)
 			continue;
 
-		device = get_device (ent->d_name);
-		if (device && strstr (driver, drivername))
-			break;
+		if (strncmp (dev, "/dev/", 5) != 0 ||
+		    !driver_matches (dev + 5, drivername) ||
+		    !add_node (drivername, dev))
+			stale = true;
+		else
+			found = true;
+	}
+	fclose (fp);
 
-		free (driver);
-		free (device);
+	if (stale)
+		nentries = first;
+
+	return found && !stale;
+}
+
+/* with the lock held */
+static void
+save_cached (void)
+{
+	FILE *fp;
+	unsigned int i;
+	char path[BUFSIZ], tmp[BUFSIZ];
+
+	if (!cache_path (path, sizeof (path)) ||
+	    snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ()) >=
+	    (int) sizeof (tmp))
+		return;
+
+	fp = fopen (tmp, "w");
+	if (!fp)
+		return;
+
+	for (i = 0; i < nentries; i++)
+		fprintf (fp, "%s %s\n", entries[i].name, entries[i].path);
+
+	/* never leave a half written cache for another process */
+	if (fclose (fp) != 0 || rename (tmp, path) != 0)
+		unlink (tmp);
+}
+
+/* find the driver's nodes, the first time it's asked for; lock held */
+static bool
+probe (const char *drivername)
+{
+	unsigned int i;
+
+	for (i = 0; i < nprobed; i++) {
+		if (strcmp (probed[i], drivername) == 0)
+			return true;
 	}
 
-	closedir (dir);
-	free (driver);
+	if (nprobed == MAX_DRIVERS || strlen (drivername) >= NAME_LEN)
+		return false;
+
+	if (!load_cached (drivername)) {
+		if (!scan_devices (drivername))
+			return false;
+		save_cached ();
+	}
+
+	snprintf (probed[nprobed++], NAME_LEN, "%s", drivername);
+	return true;
+}
+
+/* with the lock held */
+static struct dev_entry *
+least_loaded (const char *drivername)
+{
+	unsigned int i;
+	struct dev_entry *e, *best = NULL;
+
+	if (!probe (drivername))
+		return NULL;
+
+	for (i = 0; i < nentries; i++) {
+		e = &entries[i];
+		if (strcmp (e->name, drivername) != 0)
+			continue;
+
+		if (!best || e->active < best->active ||
+		    (e->active == best->active && e->fps > best->fps))
+			best = e;
+	}
+
+	return best;
+}
+
+char *
+v4l2_find_device (const char *drivername)
+{
+	char *device = NULL;
+	struct dev_entry *e;
+
+	pthread_mutex_lock (&lock);
+	e = least_loaded (drivername);
+	if (e)
+		device = strdup (e->path);
+	pthread_mutex_unlock (&lock);
 
 	return device;
 }
+
+const char *
+v4l2_device_path (int node)
+{
+	/* entries are only ever added, the pointer stays good */
+	if (node < 0 || (unsigned int) node >= MAX_NODES)
+		return NULL;
+
+	return entries[node].path;
+}
+
+static int
+open_handle (const char *device)
+{
+	int fd = open (device, O_RDWR | O_NONBLOCK, 0);
+
+	if (fd < 0)
+		return -1;
+
+	if (v4l2_mfc_querycap (fd) != 0) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* with the lock held */
+static void
+fill_pool (struct dev_entry *e)
+{
+	int fd;
+
+	while (e->nwarm < e->target) {
+		fd = open_handle (e->path);
+		if (fd < 0)
+			break;
+		e->warm[e->nwarm++] = fd;
+	}
+}
+
+int
+v4l2_open_device (const char *drivername, int *node)
+{
+	int fd = -1;
+	char device[PATH_LEN];
+	struct dev_entry *e;
+
+	/* counted right away, so the next stream goes elsewhere */
+	pthread_mutex_lock (&lock);
+	e = least_loaded (drivername);
+	if (e && e->nwarm > 0)
+		fd = e->warm[--e->nwarm];
+	else if (e)
+		snprintf (device, PATH_LEN, "%s", e->path);
+	if (e)
+		e->active++;
+	pthread_mutex_unlock (&lock);
+
+	if (!e) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (fd < 0)
+		fd = open_handle (device);
+
+	if (fd < 0) {
+		pthread_mutex_lock (&lock);
+		e->active--;
+		pthread_mutex_unlock (&lock);
+		return -1;
+	}
+
+	*node = e - entries;
+	return fd;
+}
+
+void
+v4l2_release_device (int fd, int node, double fps)
+{
+	struct dev_entry *e;
+
+	close (fd);
+
+	if (node < 0 || (unsigned int) node >= MAX_NODES)
+		return;
+
+	e = &entries[node];
+
+	pthread_mutex_lock (&lock);
+	if (e->active > 0)
+		e->active--;
+	if (fps > 0)
+		e->fps = e->fps > 0 ?
+			e->fps + FPS_WEIGHT * (fps - e->fps) : fps;
+
+	/* top the warm pool up again, off the path of opening a stream */
+	fill_pool (e);
+	pthread_mutex_unlock (&lock);
+}
+
+int
+v4l2_prewarm (const char *drivername, unsigned int count)
+{
+	int n = -1;
+	unsigned int i, k = 0, nodes = 0, target;
+	struct dev_entry *e;
+
+	pthread_mutex_lock (&lock);
+	if (probe (drivername)) {
+		for (i = 0; i < nentries; i++)
+			nodes += strcmp (entries[i].name, drivername) == 0;
+
+		/* spread over the nodes, like the streams will be */
+		n = 0;
+		for (i = 0; i < nentries; i++) {
+			e = &entries[i];
+			if (strcmp (e->name, drivername) != 0)
+				continue;
+
+			target = count / nodes + (k++ < count % nodes);
+			e->target = (target < MAX_WARM) ? target : MAX_WARM;
+
+			/* shrink right away, grow as far as the device lets us */
+			while (e->nwarm > e->target)
+				close (e->warm[--e->nwarm]);
+			fill_pool (e);
+			n += e->nwarm;
+		}
+	}
+	pthread_mutex_unlock (&lock);
+
+	if (n < 0)
+		errno = ENODEV;
+
+	return n;
+}
@@ -1,6 +1,24 @@
 #ifndef DEV_H_
 #define DEV_H_
 
+#include <stdbool.h>
+
+/* the least loaded /dev node of a driver; its nodes are found once */
 char *v4l2_find_device (const char *drivername);
 
+/* the path of a node from v4l2_open_device (), NULL if there's none */
+const char *v4l2_device_path (int node);
+
+/*
+ * An opened and queried handle on the least loaded node, from its warm
+ * pool when it has one. *node tells v4l2_release_device () which.
+ */
+int v4l2_open_device (const char *drivername, int *node);
+
+/* close the handle; fps is what its stream got, 0 when unknown */
+void v4l2_release_device (int fd, int node, double fps);
+
+/* keep count warm handles, over all the nodes; returns how many */
+int v4l2_prewarm (const char *drivername, unsigned int count);
+
 #endif
@@ -0,0 +1,455 @@
+/*
+ * Transcoding on the MFC: decoded frames never leave the hardware.
+ *
+ * 01. S_FMT(CAPTURE, V4L2_PIX_FMT_H264, sizeimage)
+ * 02. S_FMT(OUTPUT, the decoder's CAPTURE format)
+ * 03. S_CTRL(bitrate, GOP, profile)
+ * 04. REQ_BUFS(CAPTURE, m), MMAP and QBUF all of them
+ * 05. REQ_BUFS(OUTPUT, DMABUF, as many as the decoder has frames)
+ * 06. STREAM_ON(CAPTURE), STREAM_ON(OUTPUT)
+ *
+ * Then every frame dequeued from the decoder is queued to the encoder
+ * with the decoder's exported planes, and goes back to the decoder once
+ * the encoder is done with it. At the end of the decoded stream
+ * ENCODER_CMD(STOP) flushes the encoder up to its LAST buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "enc.h"
+#include "dev.h"
+
+/* bitstream buffers; the first one gets the stream header */
+#define ENC_DST_COUNT 4
+
+static bool
+set_controls (struct mfc_enc *enc, const struct vjmfc_enc_params *params)
+{
+	int id = 0;
+
+	if (params->bitrate > 0) {
+		if (v4l2_mfc_s_ctrl (enc->handler,
+				     V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE,
+				     1) != 0 ||
+		    v4l2_mfc_s_ctrl (enc->handler,
+				     V4L2_CID_MPEG_VIDEO_BITRATE,
+				     params->bitrate) != 0) {
+			perror ("Couldn't set the bitrate: ");
+			return false;
+		}
+	}
+
+	if (params->gop > 0 &&
+	    v4l2_mfc_s_ctrl (enc->handler,
+			     V4L2_CID_MPEG_VIDEO_GOP_SIZE,
+			     params->gop) != 0) {
+		perror ("Couldn't set the GOP size: ");
+		return false;
+	}
+
+	if (params->fourcc == V4L2_PIX_FMT_H264)
+		id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
+	else if (params->fourcc == V4L2_PIX_FMT_MPEG4)
+		id = V4L2_CID_MPEG_VIDEO_MPEG4_PROFILE;
+
+	if (params->profile >= 0 && id != 0 &&
+	    v4l2_mfc_s_ctrl (enc->handler, id, params->profile) != 0) {
+		perror ("Couldn't set the profile: ");
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+set_formats (struct mfc_enc *enc,
+	     const struct vjmfc_enc_params *params,
+	     const struct mfc_ctxt *dec)
+{
+	uint32_t i;
+	const struct v4l2_pix_format_mplane *raw = &dec->fmt.fmt.pix_mp;
+	struct v4l2_format fmt = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+		.fmt.pix_mp = {
+			.width = raw->width,
+			.height = raw->height,
+			.num_planes = 1,
+			.pixelformat = params->fourcc,
+			/* a coded frame never gets near its luma size */
+			.plane_fmt[0].sizeimage = raw->width * raw->height,
+		},
+	};
+
+	if (v4l2_mfc_s_fmt_mp (enc->handler, &fmt) != 0) {
+		perror ("Couldn't set the encoded format: ");
+		return false;
+	}
+
+	enc->src_fmt = (struct v4l2_format) {
+		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+		.fmt.pix_mp = {
+			.width = raw->width,
+			.height = raw->height,
+			.num_planes = raw->num_planes,
+			.pixelformat = raw->pixelformat,
+		},
+	};
+
+	if (v4l2_mfc_s_fmt_mp (enc->handler, &enc->src_fmt) != 0) {
+		perror ("Couldn't set the raw format: ");
+		return false;
+	}
+
+	/* the decoder's planes are imported as they are */
+	for (i = 0; i < enc->src_fmt.fmt.pix_mp.num_planes; i++) {
+		if (dec->out[0].planes[i].length <
+		    enc->src_fmt.fmt.pix_mp.plane_fmt[i].sizeimage) {
+			fprintf (stderr, "Decoded frames don't fit the encoder\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+setup_dst (struct mfc_enc *enc)
+{
+	uint32_t i;
+	struct mfc_buffer *b;
+
+	enc->dc = ENC_DST_COUNT;
+	if (v4l2_mfc_reqbufs (enc->handler,
+			      V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			      V4L2_MEMORY_MMAP,
+			      &enc->dc) != 0) {
+		perror ("Couldn't request bitstream buffers: ");
+		return false;
+	}
+
+	enc->dst = calloc (enc->dc, sizeof (struct mfc_buffer));
+	if (!enc->dst)
+		return false;
+
+	for (i = 0; i < enc->dc; i++)
+		enc->dst[i].paddr[0] = MAP_FAILED;
+
+	for (i = 0; i < enc->dc; i++) {
+		b = &enc->dst[i];
+
+		if (v4l2_mfc_querybuf (enc->handler,
+				       i,
+				       V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				       V4L2_MEMORY_MMAP,
+				       b->planes,
+				       &b->buf) != 0) {
+			perror ("query buffers failed: ");
+			return false;
+		}
+
+		b->paddr[0] = mmap (NULL,
+				    b->planes[0].length,
+				    PROT_READ,
+				    MAP_SHARED,
+				    enc->handler,
+				    b->planes[0].m.mem_offset);
+		if (b->paddr[0] == MAP_FAILED) {
+			perror ("mapping buffers failed: ");
+			return false;
+		}
+
+		if (v4l2_mfc_qbuf (enc->handler, &b->buf) != 0) {
+			perror ("Couldn't queue bitstream buffer: ");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+mfc_enc_open (struct mfc_enc *enc,
+	      const struct vjmfc_enc_params *params,
+	      const struct mfc_ctxt *dec,
+	      int fd)
+{
+	memset (enc, 0, sizeof (*enc));
+	enc->fd = fd;
+
+	enc->handler = v4l2_open_device (MFC_ENC_DRIVER, &enc->node);
+	if (enc->handler < 0) {
+		perror ("Couldn't open the encoder: ");
+		return false;
+	}
+
+	if (!set_formats (enc, params, dec) ||
+	    !set_controls (enc, params) ||
+	    !setup_dst (enc))
+		return false;
+
+	/* one slot per decoder frame, the driver caches each import */
+	enc->src_count = dec->oc;
+	if (v4l2_mfc_reqbufs (enc->handler,
+			      V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			      V4L2_MEMORY_DMABUF,
+			      &enc->src_count) != 0) {
+		perror ("Couldn't request frame buffers: ");
+		return false;
+	}
+
+	if (enc->src_count < dec->oc) {
+		fprintf (stderr, "Encoder takes %u frames, the decoder has %u\n",
+			 enc->src_count, dec->oc);
+		return false;
+	}
+
+	if (v4l2_mfc_streamon (enc->handler,
+			       V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) != 0 ||
+	    v4l2_mfc_streamon (enc->handler,
+			       V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) != 0) {
+		perror ("Couldn't start the encoder: ");
+		return false;
+	}
+
+	return true;
+}
+
+void
+mfc_enc_close (struct mfc_enc *enc)
+{
+	uint32_t i;
+
+	if (enc->handler < 0)
+		return;
+
+	for (i = 0; enc->dst && i < enc->dc; i++) {
+		if (enc->dst[i].paddr[0] != MAP_FAILED)
+			munmap (enc->dst[i].paddr[0],
+				enc->dst[i].planes[0].length);
+	}
+	free (enc->dst);
+	enc->dst = NULL;
+
+	v4l2_release_device (enc->handler, enc->node, 0);
+	enc->handler = -1;
+}
+
+static bool
+queue_src (struct mfc_enc *enc, const struct mfc_buffer *frame)
+{
+	uint32_t i;
+	struct v4l2_plane planes[2];
+	struct v4l2_buffer buf = {
+		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+		.memory = V4L2_MEMORY_DMABUF,
+		.index = frame->buf.index,
+		.m.planes = planes,
+		.length = frame->buf.length,
+	};
+
+	memset (planes, 0, sizeof (planes));
+	for (i = 0; i < frame->buf.length; i++) {
+		planes[i].m.fd = frame->dmabuf[i];
+		planes[i].length = frame->planes[i].length;
+		planes[i].bytesused = frame->planes[i].bytesused;
+	}
+
+	if (v4l2_mfc_qbuf (enc->handler, &buf) != 0) {
+		perror ("Couldn't queue frame to the encoder: ");
+		return false;
+	}
+
+	enc->src_queued++;
+	enc->frames++;
+	return true;
+}
+
+/* hand the decoded frames over */
+static bool
+encode_frames (struct mfc_enc *enc, struct mfc_ctxt *dec)
+{
+	int ret;
+	uint32_t idx;
+
+	while ((ret = mfc_ctxt_dequeue_frame (dec, &idx)) > 0) {
+		if (!queue_src (enc, &dec->out[idx]))
+			return false;
+		dec->frames++;
+	}
+
+	return ret == 0;
+}
+
+/* and give them back to the decoder once encoded */
+static bool
+release_frames (struct mfc_enc *enc, struct mfc_ctxt *dec)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[2];
+
+	while (v4l2_mfc_dqbuf (enc->handler,
+			       &buf,
+			       planes,
+			       V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			       V4L2_MEMORY_DMABUF) == 0) {
+		assert (enc->src_queued > 0);
+		enc->src_queued--;
+
+		if (!mfc_ctxt_queue_frame (dec, buf.index))
+			return false;
+	}
+
+	if (errno != EAGAIN) {
+		perror ("Couldn't dequeue encoded frame: ");
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+write_all (int fd, const uint8_t *data, uint32_t size)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write (fd, data, size);
+		if (ret < 0)
+			return false;
+		data += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static bool
+write_stream (struct mfc_enc *enc)
+{
+	uint32_t size;
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[2];
+
+	while (v4l2_mfc_dqbuf (enc->handler,
+			       &buf,
+			       planes,
+			       V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			       V4L2_MEMORY_MMAP) == 0) {
+		size = planes[0].bytesused;
+
+		if (!write_all (enc->fd, enc->dst[buf.index].paddr[0], size)) {
+			perror ("Couldn't write the stream: ");
+			return false;
+		}
+		enc->bytes += size;
+
+		if (buf.flags & V4L2_BUF_FLAG_LAST ||
+		    (enc->stopping && size == 0)) {
+			enc->done = true;
+			return true;
+		}
+
+		if (v4l2_mfc_qbuf (enc->handler, &enc->dst[buf.index].buf) != 0) {
+			perror ("Couldn't queue bitstream buffer: ");
+			return false;
+		}
+	}
+
+	/* EPIPE: the last buffer has already been dequeued */
+	if (errno == EPIPE) {
+		enc->done = true;
+	} else if (errno != EAGAIN) {
+		perror ("Couldn't dequeue bitstream buffer: ");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+mfc_enc_transcode (struct mfc_enc *enc, struct mfc_ctxt *dec)
+{
+	int ret;
+	struct pollfd pfd[2] = {
+		{ .events = POLLIN | POLLOUT | POLLPRI },
+		{ .fd = enc->handler, .events = POLLIN | POLLOUT },
+	};
+
+	while (!enc->done) {
+		if (!dec->done && !mfc_ctxt_feed (dec))
+			return false;
+
+		/* everything decoded is queued, flush the encoder */
+		if (dec->done && !enc->stopping) {
+			if (v4l2_mfc_encoder_cmd (enc->handler,
+						  V4L2_ENC_CMD_STOP) != 0) {
+				perror ("Couldn't stop the encoder: ");
+				return false;
+			}
+			enc->stopping = true;
+		}
+
+		/*
+		 * With every frame in the encoder the driver takes the
+		 * decoder's empty queues for an error: wait for the encoder.
+		 */
+		pfd[0].fd = (dec->done || dec->out_queued == 0) ?
+			-1 : dec->handler;
+
+		ret = poll (pfd, 2, POLL_TIMEOUT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("Couldn't poll the devices: ");
+			return false;
+		}
+
+		if (ret == 0) {
+			/* some drivers never flag the last buffer */
+			if (enc->stopping)
+				break;
+			if (dec->eos) {
+				dec->done = true;
+				continue;
+			}
+			fprintf (stderr, "Timeout waiting for the devices\n");
+			return false;
+		}
+
+		if ((pfd[0].revents | pfd[1].revents) & POLLERR) {
+			fprintf (stderr, "Device reported an error\n");
+			return false;
+		}
+
+		if (pfd[0].revents & POLLPRI) {
+			if (!mfc_ctxt_handle_events (dec))
+				return false;
+			/* the encoder was set up for the first resolution */
+			if (dec->resizing) {
+				fprintf (stderr, "Can't transcode across a "
+					 "resolution change\n");
+				return false;
+			}
+		}
+
+		if (pfd[0].revents & POLLOUT && !mfc_ctxt_dequeue_input (dec))
+			return false;
+
+		if (pfd[0].revents & POLLIN && !encode_frames (enc, dec))
+			return false;
+
+		if (pfd[1].revents & POLLOUT && !release_frames (enc, dec))
+			return false;
+
+		if (pfd[1].revents & POLLIN && !write_stream (enc))
+			return false;
+	}
+
+	return true;
+}
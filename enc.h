@@ -0,0 +1,41 @@
+#ifndef MFC_ENC_H_
+#define MFC_ENC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mfc.h"
+
+#define MFC_ENC_DRIVER "s5p-mfc-enc"
+
+/*
+ * The MFC encoder fed with the decoder's CAPTURE buffers. Its OUTPUT
+ * buffers import the decoder's dmabufs, one encoder index per decoder
+ * index so the driver keeps each import mapped; the bitstream comes
+ * back in mapped CAPTURE buffers and goes to fd.
+ */
+struct mfc_enc {
+	int handler;
+	int node;
+	int fd;
+
+	struct v4l2_format src_fmt;
+	uint32_t src_count, src_queued;
+
+	struct mfc_buffer *dst;
+	uint32_t dc;
+
+	bool stopping, done;
+	uint64_t frames, bytes;
+};
+
+bool mfc_enc_open (struct mfc_enc *enc,
+		   const struct vjmfc_enc_params *params,
+		   const struct mfc_ctxt *dec,
+		   int fd);
+void mfc_enc_close (struct mfc_enc *enc);
+
+/* decode dec's file and encode every frame, no pixel touches the CPU */
+bool mfc_enc_transcode (struct mfc_enc *enc, struct mfc_ctxt *dec);
+
+#endif
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/videodev2.h>
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "es.h"
+
+static const struct {
+	const char *ext;
+	uint32_t codec;
+} extensions[] = {
+	{ "h264", V4L2_PIX_FMT_H264 },
+	{ "264", V4L2_PIX_FMT_H264 },
+	{ "h26l", V4L2_PIX_FMT_H264 },
+	{ "m4v", V4L2_PIX_FMT_MPEG4 },
+	{ "cmp", V4L2_PIX_FMT_MPEG4 },
+	{ "h263", V4L2_PIX_FMT_H263 },
+	{ "263", V4L2_PIX_FMT_H263 },
+	/* MPEG-1 or 2, told apart by the sequence extension */
+	{ "m1v", V4L2_PIX_FMT_MPEG1 },
+	{ "m2v", V4L2_PIX_FMT_MPEG1 },
+	{ "mpv", V4L2_PIX_FMT_MPEG1 },
+};
+
+static uint32_t
+codec_from_name (const char *filename)
+{
+	size_t i;
+	const char *ext = strrchr (filename, '.');
+
+	if (!ext)
+		return 0;
+
+	for (i = 0; i < sizeof (extensions) / sizeof (extensions[0]); i++) {
+		if (strcasecmp (ext + 1, extensions[i].ext) == 0)
+			return extensions[i].codec;
+	}
+
+	return 0;
+}
+
+/*
+ * Can any of the 16 positions at p start with 00 00? Reads 17 bytes.
+ * Coded data rarely has two zeros in a row, so most blocks are skipped
+ * whole and only the rest is looked at byte by byte.
+ */
+#if HAVE_NEON
+static inline bool
+block_has_zeros (const uint8_t *p)
+{
+	uint8x16_t zero = vdupq_n_u8 (0);
+	uint8x16_t m = vandq_u8 (vceqq_u8 (vld1q_u8 (p), zero),
+				 vceqq_u8 (vld1q_u8 (p + 1), zero));
+	uint64x2_t m64 = vreinterpretq_u64_u8 (m);
+
+	return (vgetq_lane_u64 (m64, 0) | vgetq_lane_u64 (m64, 1)) != 0;
+}
+#elif HAVE_SSE2
+static inline bool
+block_has_zeros (const uint8_t *p)
+{
+	__m128i zero = _mm_setzero_si128 ();
+	__m128i a = _mm_loadu_si128 ((const __m128i *) p);
+	__m128i b = _mm_loadu_si128 ((const __m128i *) (p + 1));
+
+	return _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, zero),
+						 _mm_cmpeq_epi8 (b, zero))) != 0;
+}
+#endif
+
+static size_t
+scan_bytes (const uint8_t *p, size_t i, size_t end, size_t size)
+{
+	for (; i < end && i + 2 < size; i++) {
+		/* the third byte rules out most positions at once */
+		if (p[i + 2] > 1)
+			i += 2;
+		else if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1)
+			return i;
+	}
+
+	return size;
+}
+
+size_t
+es_find_start_code (const uint8_t *p, size_t size)
+{
+	size_t i = 0;
+
+#if HAVE_NEON || HAVE_SSE2
+	size_t r;
+
+	for (; i + 17 <= size; i += 16) {
+		if (!block_has_zeros (p + i))
+			continue;
+
+		r = scan_bytes (p, i, i + 16, size);
+		if (r < size)
+			return r;
+	}
+#endif
+
+	/* the tail, or everything without SIMD */
+	return scan_bytes (p, i, size, size);
+}
+
+/* H.263 picture start code: 22 bits, 0000 0000 0000 0000 1000 00 */
+static size_t
+find_h263_psc (const uint8_t *p, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 2 < size; i++) {
+		if (p[i] == 0 && p[i + 1] == 0 && (p[i + 2] & 0xfc) == 0x80)
+			return i;
+	}
+
+	return size;
+}
+
+static size_t
+find_unit (const struct es *es, size_t pos)
+{
+	size_t off;
+
+	if (es->codec == V4L2_PIX_FMT_H263)
+		off = find_h263_psc (es->data + pos, es->size - pos);
+	else
+		off = es_find_start_code (es->data + pos, es->size - pos);
+
+	return pos + off;
+}
+
+/* byte after the start code at off, or -1 past the end */
+static int
+unit_byte (const struct es *es, size_t off, size_t i)
+{
+	return off + 3 + i < es->size ? es->data[off + 3 + i] : -1;
+}
+
+/* does the unit at off hold picture data? */
+static bool
+is_picture (const struct es *es, size_t off)
+{
+	int c = unit_byte (es, off, 0);
+
+	switch (es->codec) {
+	case V4L2_PIX_FMT_H264:
+		c &= 0x1f;
+		return c == 1 || c == 5;
+	case V4L2_PIX_FMT_MPEG4:
+		return c == 0xb6;
+	case V4L2_PIX_FMT_H263:
+		return true;
+	default:
+		return c == 0x00;
+	}
+}
+
+/*
+ * Does the unit at off open a new access unit, given whether the
+ * current one already has picture data?
+ */
+static bool
+opens_au (const struct es *es, size_t off, bool pic)
+{
+	int c = unit_byte (es, off, 0);
+
+	if (!pic)
+		return false;
+
+	switch (es->codec) {
+	case V4L2_PIX_FMT_H264:
+		c &= 0x1f;
+		/* a slice with first_mb_in_slice == 0 starts a picture */
+		if (c == 1 || c == 5)
+			return unit_byte (es, off, 1) & 0x80;
+		return (c >= 6 && c <= 9) || (c >= 14 && c <= 18);
+	case V4L2_PIX_FMT_MPEG4:
+		/* VOS, GOV or VOP */
+		return c == 0xb0 || c == 0xb3 || c == 0xb6;
+	case V4L2_PIX_FMT_H263:
+		return true;
+	default:
+		/* sequence header, GOP or picture */
+		return c == 0xb3 || c == 0xb8 || c == 0x00;
+	}
+}
+
+/* where the header ends: the first unit belonging to a frame */
+static bool
+opens_frame (const struct es *es, size_t off)
+{
+	int c = unit_byte (es, off, 0);
+
+	switch (es->codec) {
+	case V4L2_PIX_FMT_MPEG4:
+		return c == 0xb3 || c == 0xb6;
+	case V4L2_PIX_FMT_MPEG1:
+	case V4L2_PIX_FMT_MPEG2:
+		return c == 0xb8 || c == 0x00;
+	default:
+		return is_picture (es, off);
+	}
+}
+
+/* keep the zero of a 4-byte start code with the unit it opens */
+static size_t
+unit_start (const struct es *es, size_t off, size_t from)
+{
+	return (off > from && es->data[off - 1] == 0) ? off - 1 : off;
+}
+
+static bool
+find_header (struct es *es)
+{
+	size_t off = find_unit (es, 0);
+
+	/* raw streams open with a start code */
+	if (off > 4 || off >= es->size)
+		return false;
+
+	for (; off < es->size; off = find_unit (es, off + 3)) {
+		/* a sequence extension makes it MPEG-2 */
+		if (es->codec == V4L2_PIX_FMT_MPEG1 &&
+		    unit_byte (es, off, 0) == 0xb5 &&
+		    unit_byte (es, off, 1) >> 4 == 1)
+			es->codec = V4L2_PIX_FMT_MPEG2;
+
+		if (opens_frame (es, off)) {
+			es->header_size = unit_start (es, off, 0);
+			es->pos = es->header_size;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+es_open (struct es *es, const char *filename)
+{
+	int fd;
+	void *data;
+	struct stat st;
+
+	memset (es, 0, sizeof (*es));
+
+	es->codec = codec_from_name (filename);
+	if (es->codec == 0)
+		return false;
+
+	fd = open (filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (fstat (fd, &st) != 0 || st.st_size == 0) {
+		close (fd);
+		return false;
+	}
+
+	posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	madvise (data, st.st_size, MADV_SEQUENTIAL);
+	es->data = data;
+	es->size = st.st_size;
+
+	if (!find_header (es)) {
+		fprintf (stderr, "%s doesn't look like a raw stream\n",
+			 filename);
+		es_close (es);
+		return false;
+	}
+
+	return true;
+}
+
+void
+es_close (struct es *es)
+{
+	if (es->data)
+		munmap ((void *) es->data, es->size);
+	memset (es, 0, sizeof (*es));
+}
+
+bool
+es_next (struct es *es, const uint8_t **au, size_t *size)
+{
+	size_t start = es->pos, off, end = es->size;
+	bool pic = false;
+
+	if (start >= es->size)
+		return false;
+
+	for (off = find_unit (es, start); off < es->size;
+	     off = find_unit (es, off + 3)) {
+		if (off > start + 1 && opens_au (es, off, pic)) {
+			end = unit_start (es, off, start);
+			break;
+		}
+		if (is_picture (es, off))
+			pic = true;
+	}
+
+	*au = es->data + start;
+	*size = end - start;
+	es->pos = end;
+	es->frames++;
+
+	return true;
+}
+
+void
+es_unread (struct es *es, size_t size)
+{
+	es->pos -= size;
+	es->frames--;
+}
+
+#define ES_SAMPLE_FRAMES 32
+
+uint32_t
+es_frame_size (struct es *es)
+{
+	size_t pos = es->pos, size, total = 0;
+	uint32_t frames = es->frames, n = 0;
+	const uint8_t *au;
+
+	while (n < ES_SAMPLE_FRAMES && es_next (es, &au, &size)) {
+		total += size;
+		n++;
+	}
+
+	es->pos = pos;
+	es->frames = frames;
+
+	return n ? total / n : 0;
+}
+
+/* is the picture starting at off intra coded? */
+static bool
+is_intra (const struct es *es, size_t off)
+{
+	int b4 = unit_byte (es, off, 1), b5 = unit_byte (es, off, 2);
+
+	switch (es->codec) {
+	case V4L2_PIX_FMT_H264:
+		return (unit_byte (es, off, 0) & 0x1f) == 5;
+	case V4L2_PIX_FMT_MPEG4:
+		/* vop_coding_type, the first two bits */
+		return b4 >= 0 && (b4 >> 6) == 0;
+	case V4L2_PIX_FMT_H263:
+		/* PTYPE bit 9, the 39th bit from the start code */
+		return b4 >= 0 && !(b4 & 0x02);
+	default:
+		/* picture_coding_type, after a 10 bit temporal reference */
+		return b5 >= 0 && ((b5 >> 3) & 7) == 1;
+	}
+}
+
+static bool
+au_is_key (const struct es *es, size_t start, size_t end)
+{
+	size_t off;
+
+	for (off = find_unit (es, start); off < end; off = find_unit (es, off + 3)) {
+		if (is_picture (es, off))
+			return is_intra (es, off);
+	}
+
+	return false;
+}
+
+bool
+es_is_key (const struct es *es, const uint8_t *au, size_t size)
+{
+	size_t start = au - es->data;
+
+	return au_is_key (es, start, start + size);
+}
+
+uint32_t
+es_seek (struct es *es, uint32_t frame)
+{
+	size_t key_pos = es->header_size, start, size;
+	uint32_t key = 0;
+	const uint8_t *au;
+
+	es->pos = es->header_size;
+	es->frames = 0;
+
+	while (es->frames <= frame && es_next (es, &au, &size)) {
+		start = au - es->data;
+		if (au_is_key (es, start, start + size)) {
+			key_pos = start;
+			key = es->frames - 1;
+		}
+	}
+
+	es->pos = key_pos;
+	es->frames = key;
+
+	return key;
+}
@@ -0,0 +1,49 @@
+#ifndef ES_H_
+#define ES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Raw elementary streams (H.264 Annex-B, MPEG-4 part 2, H.263 and
+ * MPEG-1/2 video), mmapped and cut into access units at their start
+ * codes, so they never go through libavformat's probing.
+ */
+struct es {
+	const uint8_t *data;	/* NULL when not in use */
+	size_t size, pos;
+	uint32_t codec;		/* V4L2_PIX_FMT_* */
+
+	/* the stream header is data[0, header_size), may be empty */
+	size_t header_size;
+
+	uint32_t frames;
+};
+
+/* fails, leaving es unused, for anything that doesn't look raw */
+bool es_open (struct es *es, const char *filename);
+void es_close (struct es *es);
+
+/* the next access unit; false at the end of the stream */
+bool es_next (struct es *es, const uint8_t **au, size_t *size);
+
+/* give back the access unit es_next () just returned */
+void es_unread (struct es *es, size_t size);
+
+/* average access unit size over the first frames, without consuming */
+uint32_t es_frame_size (struct es *es);
+
+/* is the access unit from es_next () intra coded? */
+bool es_is_key (const struct es *es, const uint8_t *au, size_t size);
+
+/*
+ * Go back to the last keyframe at or before the given frame number,
+ * which is returned. Frames are counted from 0 after the header.
+ */
+uint32_t es_seek (struct es *es, uint32_t frame);
+
+/* offset of the next 00 00 01 in p, or size if there is none */
+size_t es_find_start_code (const uint8_t *p, size_t size);
+
+#endif
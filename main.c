@@ -1,400 +1,780 @@
-/*******************************************************************************
- * ==============================
- * Decoding initialization path
- * ==============================
- *
- * First the OUTPUT queue is initialized. With S_FMT the application
- * chooses which video format to decode and what size should be the
- * input buffer. Fourcc values have been defined for different codecs
- * e.g.  V4L2_PIX_FMT_H264 for h264. Then the OUTPUT buffers are
- * requested and mmaped. The stream header frame is loaded into the
- * first buffer, queued and streaming is enabled. At this point the
- * hardware is able to start processing the stream header and
- * afterwards it will have information about the video dimensions and
- * the size of the buffers with raw video data.
- *
- * The next step is setting up the CAPTURE queue and buffers. The
- * width, height, buffer size and minimum number of buffers can be
- * read with G_FMT call. The application can request more output
- * buffer if necessary. After requesting and mmaping buffers the
- * device is ready to decode video stream.
- *
- * The stream frames (ES frames) are written to the OUTPUT buffers,
- * and decoded video frames can be read from the CAPTURE buffers. When
- * no more source frames are present a single buffer with bytesused
- * set to 0 should be queued. This will inform the driver that
- * processing should be finished and it can dequeue all video frames
- * that are still left. The number of such frames is dependent on the
- * stream and its internal structure (how many frames had to be kept
- * as reference frames for decoding, etc).
- *
- * ===============
- *  Usage summary
- * ===============
- *
- * This is a step by step summary of the video decoding (from user
- * application point of view, with 2 treads and blocking api):
- *
- * 01. S_FMT(OUTPUT, V4L2_PIX_FMT_H264, ...)
- * 02. REQ_BUFS(OUTPUT, n)
- * 03. for i=1..n MMAP(OUTPUT, i)
- * 04. put stream header to buffer #1
- * 05. QBUF(OUTPUT, #1)
- * 06. STREAM_ON(OUTPUT)
- * 07. G_FMT(CAPTURE)
- * 08. REQ_BUFS(CAPTURE, m)
- * 09. for j=1..m MMAP(CAPTURE, j)
- * 10. for j=1..m QBUF(CAPTURE, #j)
- * 11. STREAM_ON(CAPTURE)
- *
- * display thread:
- * 12. DQBUF(CAPTURE) -> got decoded video data in buffer #j
- * 13. display buffer #j
- * 14. QBUF(CAPTURE, #j)
- * 15. goto 12
- *
- * parser thread:
- * 16. put next ES frame to buffer #i
- * 17. QBUF(OUTPUT, #i)
- * 18. DQBUF(OUTPUT) -> get next empty buffer #i 19. goto 16
- *
- * ...
- *
- * Similar usage sequence can be achieved with single threaded
- * application and non-blocking api with poll() call.
- *
- * https://lwn.net/Articles/419695/
- ******************************************************************************/
-
 #include <stdbool.h>
 #include <stdint.h>
-#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
-#include <assert.h>
+#include <sys/stat.h>
 
-#include "v4l2_mfc.h"
-#include "dev.h"
-#include "av.h"
+#include <linux/videodev2.h>
 
-enum dir { IN, OUT };
+#include "vjmfc.h"
+#include "bench.h"
+#include "thumb.h"
 
-struct mfc_buffer {
-	void *paddr[2];
-	struct v4l2_plane planes[2];
-	struct v4l2_buffer buf;
-};
+static bool
+parse_count (const char *arg, uint32_t *count)
+{
+	char *end;
+	unsigned long v;
 
-struct mfc_ctxt {
-	int handler;
-	AVFormatContext *fc;
-	struct mfc_buffer *in, *out;
-	uint32_t ic, oc;
-};
+	errno = 0;
+	v = strtoul (arg, &end, 10);
+	if (errno || *end != '\0' || v > VIDEO_MAX_FRAME)
+		return false;
 
-static struct mfc_ctxt *
-mfc_ctxt_new ()
-{
-	struct mfc_ctxt *ctxt = calloc (1, sizeof (struct mfc_ctxt));
-	ctxt->handler = -1;
-	return ctxt;
+	*count = v;
+	return true;
 }
 
+/* PACKETS[,MIB] */
 static bool
-mfc_ctxt_open (struct mfc_ctxt *ctxt, const char *filename)
+parse_read_ahead (const char *arg, struct vjmfc_params *params)
 {
-	ctxt->fc = av_context_new (filename);
-	if (!ctxt->fc)
+	char *end;
+	unsigned long packets, mib = 0;
+
+	errno = 0;
+	packets = strtoul (arg, &end, 10);
+	if (*end == ',')
+		mib = strtoul (end + 1, &end, 10);
+	if (errno || *end != '\0' || packets == 0 || packets > 65536 ||
+	    mib > 4096)
 		return false;
 
-	char *dev = v4l2_find_device("s5p-mfc-dec");
-	if (!dev)
-		return false;
+	params->read_ahead = packets;
+	params->read_ahead_bytes = (size_t) mib << 20;
+	return true;
+}
+
+static bool
+parse_preset (const char *name, enum vjmfc_preset *preset)
+{
+	size_t i;
+	static const struct {
+		const char *name;
+		enum vjmfc_preset preset;
+	} presets[] = {
+		{ "default", VJMFC_PRESET_DEFAULT },
+		{ "latency", VJMFC_PRESET_LATENCY },
+		{ "throughput", VJMFC_PRESET_THROUGHPUT },
+	};
+
+	for (i = 0; i < sizeof (presets) / sizeof (presets[0]); i++) {
+		if (strcmp (presets[i].name, name) == 0) {
+			*preset = presets[i].preset;
+			return true;
+		}
+	}
+
+	return false;
+}
 
-	ctxt->handler = open (dev, O_RDWR | O_NONBLOCK, 0);
-	free (dev);
-	if (ctxt->handler < 0)
+static bool
+parse_bench (const char *name, enum bench_format *format)
+{
+	if (!name || strcmp (name, "text") == 0)
+		*format = BENCH_TEXT;
+	else if (strcmp (name, "csv") == 0)
+		*format = BENCH_CSV;
+	else if (strcmp (name, "json") == 0)
+		*format = BENCH_JSON;
+	else
 		return false;
 
-	if (v4l2_mfc_querycap (ctxt->handler) != 0)
+	return true;
+}
+
+static bool
+parse_format (const char *name, enum vjmfc_pixfmt *format)
+{
+	if (strcmp (name, "nv12") == 0)
+		*format = VJMFC_PIXFMT_NV12;
+	else if (strcmp (name, "i420") == 0)
+		*format = VJMFC_PIXFMT_I420;
+	else if (strcmp (name, "rgb") == 0)
+		*format = VJMFC_PIXFMT_RGB24;
+	else
 		return false;
 
 	return true;
 }
 
 static void
-mfc_ctxt_close (struct mfc_ctxt *ctxt)
+count_frame (const struct vjmfc_frame *frame, void *data)
 {
-	if (ctxt->fc)
-		av_context_free (&ctxt->fc);
+	uint32_t *frames = data;
+	(*frames)++;
+}
 
-	if (ctxt->handler != -1) {
-		close (ctxt->handler);
-		ctxt->handler = -1;
-	}
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 static void
-unmap_buffers (struct mfc_ctxt *ctxt, enum dir d)
+report_startup (struct vjmfc *dec)
 {
-	int res;
-	uint32_t i, j, c;
-	struct mfc_buffer *b;
-
-	c = (d == IN) ? ctxt->ic : ctxt->oc;
-	b = (d == IN) ? ctxt->in : ctxt->out;
-
-	for (i = 0; i < c; i++) {
-		for (j = 0; j < b[i].buf.length; j++) {
-			if (b[i].paddr[j] && b[i].paddr[j] != MAP_FAILED) {
-				res = munmap (b[i].paddr[j], b[i].planes[j].length);
-				if (res != 0)
-					perror ("Couldn't unmap a plane");
-			}
-		}
-	}
+	struct vjmfc_startup s;
+
+	vjmfc_get_startup (dec, &s);
+	printf ("> startup (ms):   probe %.2f  stream info %.2f\n",
+		s.probe, s.stream_info);
+	printf (">                 device %.2f  buffers %.2f (alongside)\n",
+		s.device, s.buffers);
+	printf (">                 header %.2f  capture %.2f\n",
+		s.header, s.capture);
+	printf (">                 first frame %.2f\n", s.first_frame);
 }
 
 static void
-mfc_ctxt_free (struct mfc_ctxt *ctxt)
+report (uint32_t frames, double elapsed)
 {
-	unmap_buffers (ctxt, IN);
-	unmap_buffers (ctxt, OUT);
-	free (ctxt->in);
-	free (ctxt->out);
-	free (ctxt);
+	printf ("> %u frames in %.3f s (%.1f fps)\n", frames, elapsed,
+		elapsed > 0 ? frames / elapsed : 0.0);
 }
 
-inline static bool
-map_planes (int fd, struct mfc_buffer *b)
+/* one file after the other through the one decoder */
+static int
+decode_concat (char **files, int n, const struct vjmfc_params *params)
 {
-	uint32_t i;
-	struct v4l2_buffer *buf = &b->buf;
-
-	for (i = 0; i < buf->length; i++) {
-		if (buf->m.planes[i].length == 0)
-			continue;
-
-		b->paddr[i] = mmap (NULL,
-				    buf->m.planes[i].length,
-				    PROT_READ | PROT_WRITE,
-				    MAP_SHARED,
-				    fd,
-				    buf->m.planes[i].m.mem_offset);
+	int i, ret = EXIT_FAILURE;
+	uint32_t frames, total = 0;
+	struct vjmfc *dec;
+	double start, restart;
+
+	start = now ();
+	dec = vjmfc_open (files[0], params);
+	if (!dec) {
+		perror ("Couldn't open input file: ");
+		return ret;
+	}
 
-		if (b->paddr[i] == MAP_FAILED)
-			return false;
+	for (i = 0; i < n; i++) {
+		if (i > 0) {
+			restart = now ();
+			if (vjmfc_restart (dec, files[i]) != 0) {
+				fprintf (stderr, "Couldn't go on with %s\n",
+					 files[i]);
+				goto out;
+			}
+			printf ("> %s: restarted in %.2f ms\n", files[i],
+				(now () - restart) * 1e3);
+		}
 
-		memset (b->paddr[i], 0, buf->m.planes[i].length);
+		frames = 0;
+		if (vjmfc_decode (dec, count_frame, &frames) != 0)
+			goto out;
+		printf ("> %s: %u frames\n", files[i], frames);
+		total += frames;
 	}
 
-	return true;
+	report (total, now () - start);
+	ret = EXIT_SUCCESS;
+
+out:
+	vjmfc_close (dec);
+	return ret;
 }
 
-static bool
-create_buffers (struct mfc_ctxt *ctxt, enum dir d)
+static int
+decode_many (char **files, int n, const struct vjmfc_params *params)
 {
-	uint32_t i, c;
-	struct mfc_buffer *b;
-
-	c = (d == IN) ? ctxt->ic : ctxt->oc;
-	b = (d == IN) ? ctxt->in : ctxt->out;
-	enum v4l2_buf_type type = (d == IN) ?
-		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE :
-		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-
-	for (i = 0; i < c; i++) {
-		if (v4l2_mfc_querybuf (ctxt->handler,
-				       i,
-				       type,
-				       V4L2_MEMORY_MMAP,
-				       b[i].planes,
-				       &b[i].buf) != 0) {
-			perror ("query buffers failed: ");
-			return false;
-		}
-
-		printf ("> %s buffer %d has %d plane(s)\n",
-			(d == IN) ? "input" : "output", i, b[i].buf.length);
-		assert (b[i].buf.length < 2);
+	int i, ret = EXIT_FAILURE;
+	uint32_t total = 0;
+	uint32_t *frames;
+	void **data;
+	struct vjmfc **decs;
+	double start;
+
+	decs = calloc (n, sizeof (struct vjmfc *));
+	frames = calloc (n, sizeof (uint32_t));
+	data = calloc (n, sizeof (void *));
+	if (!decs || !frames || !data)
+		goto bail;
 
-		if (!map_planes (ctxt->handler, b)) {
-			perror ("mapping buffers failed: ");
-			return false;
+	for (i = 0; i < n; i++) {
+		decs[i] = vjmfc_open (files[i], params);
+		if (!decs[i]) {
+			fprintf (stderr, "Couldn't open %s: %s\n", files[i],
+				 strerror (errno));
+			goto bail;
 		}
+		data[i] = &frames[i];
 	}
 
-	return true;
-}
-
-static bool
-queue_buffers (struct mfc_ctxt *ctxt, enum dir d)
-{
-	uint32_t i, c;
-	struct mfc_buffer *b;
+	start = now ();
+	if (vjmfc_decode_many (decs, n, count_frame, data) == 0)
+		ret = EXIT_SUCCESS;
 
-	c = (d == IN) ? ctxt->ic : ctxt->oc;
-	b = (d == IN) ? ctxt->in : ctxt->out;
-
-	for (i = 0; i < c; i++) {
-		if (v4l2_mfc_qbuf (ctxt->handler, &b[i].buf) != 0) {
-			perror ("Couldn't queue buffers: ");
-			return false;
-		}
+	for (i = 0; i < n; i++) {
+		printf ("> %s: decoded %u frames\n", files[i], frames[i]);
+		total += frames[i];
 	}
+	report (total, now () - start);
 
-	return true;
+bail:
+	for (i = 0; decs && i < n; i++)
+		vjmfc_close (decs[i]);
+	free (decs);
+	free (frames);
+	free (data);
+	return ret;
 }
 
+struct async_run {
+	struct vjmfc *dec;
+	uint32_t frames;
+	bool drained, failed;
+};
+
 static void
-fill_first_input_buffer (struct mfc_ctxt *ctxt)
+async_frame (const struct vjmfc_frame *frame, void *data)
 {
-	struct mfc_buffer *b;
-	uint8_t *data;
-	int size;
-
-	b = &ctxt->in[0];
+	struct async_run *run = data;
 
-	data = get_codec_extradata (ctxt->fc, &size);
-	if (size > 0)
-		memcpy (b->paddr, data, size);
+	run->frames++;
+	if (vjmfc_release_frame (run->dec, frame) != 0)
+		run->failed = true;
 }
 
-static bool
-prepare_buffers (struct mfc_ctxt *ctxt, enum dir d)
+static void
+async_drained (void *data)
 {
-	struct mfc_buffer *buf;
-	uint32_t count = (d == IN) ? 1 : 2;
-	enum v4l2_buf_type type = (d == IN) ?
-		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE :
-		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-
-	if (v4l2_mfc_reqbufs (ctxt->handler,
-			      type,
-			      V4L2_MEMORY_MMAP,
-			      &count) != 0) {
-		perror ("Couldn't request buffers: ");
-		return false;
-	}
-
-	buf = (struct mfc_buffer *) calloc (count, sizeof (struct mfc_buffer));
-
-	if (d == IN) {
-		ctxt->ic = count;
-		ctxt->in = buf;
-	} else {
-		ctxt->oc = count;
-		ctxt->out = buf;
-	}
-
-	return true;
+	struct async_run *run = data;
+	run->drained = true;
 }
 
+/* the way an event loop would drive the decoder */
 static bool
-mfc_ctxt_setup_input_buffers (struct mfc_ctxt *ctxt)
+decode_async (struct vjmfc *dec, uint32_t *frames)
 {
-	uint32_t codec = get_codec_id (ctxt->fc);
-	if (codec == 0) {
-		perror ("Couldn't recognize the codec: ");
+	int fd, ret;
+	struct async_run run = {
+		.dec = dec,
+	};
+	struct vjmfc_callbacks cbs = {
+		.frame_ready = async_frame,
+		.drained = async_drained,
+		.data = &run,
+	};
+	struct pollfd pfd = {
+		.events = POLLIN,
+	};
+
+	fd = vjmfc_set_async (dec, &cbs);
+	if (fd < 0)
 		return false;
-	}
 
-	if (v4l2_mfc_s_fmt (ctxt->handler, codec, 1024 * 3072) != 0) {
-		perror ("Couldn't set format: ");
-		return false;
+	pfd.fd = fd;
+	while (!run.drained && !run.failed) {
+		ret = poll (&pfd, 1, 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf (stderr, "Timeout waiting for the decoder\n");
+			return false;
+		}
+		if (vjmfc_dispatch (dec) != 0)
+			return false;
 	}
 
-	if (!prepare_buffers (ctxt, IN))
-		return false;
-
-	if (!create_buffers (ctxt, IN))
-		return false;
-
-	fill_first_input_buffer (ctxt);
+	*frames = run.frames;
+	return !run.failed;
+}
 
-	if (!queue_buffers (ctxt, IN))
-		return false;
+static void
+write_trace (const char *filename)
+{
+	int err = vjmfc_trace_dump (filename);
 
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	if (v4l2_mfc_streamon (ctxt->handler, type) != 0) {
-		perror ("Couldn't set stream on: ");
-		return false;;
-	}
+	if (err < 0)
+		fprintf (stderr, "Couldn't write the trace to %s: %s\n",
+			 filename, strerror (-err));
+}
 
-	return true;
+static void
+print_counters (unsigned int slot, const struct vjmfc_counters *c)
+{
+	double secs = (c->updated > c->opened) ?
+		(c->updated - c->opened) / 1e9 : 0.0;
+
+	printf ("%2u  %.4s %ux%u  %llu frames (%.1f fps), %llu packets, "
+		"%llu bytes\n",
+		slot, c->fourcc ? (const char *) &c->fourcc : "----",
+		c->width, c->height,
+		(unsigned long long) c->frames,
+		secs > 0 ? c->frames / secs : 0.0,
+		(unsigned long long) c->packets,
+		(unsigned long long) c->bytes);
+	printf ("    queued %u/%u, capture buffers %u, %llu dropped, "
+		"%llu EAGAIN, %llu EPIPE, %llu errors, %llu mapped, "
+		"%llu resolution changes\n",
+		c->output_queued, c->capture_queued, c->capture_buffers,
+		(unsigned long long) c->dropped,
+		(unsigned long long) c->eagain,
+		(unsigned long long) c->epipe,
+		(unsigned long long) c->errors,
+		(unsigned long long) c->mapped,
+		(unsigned long long) c->resolution_changes);
 }
 
+/* the live decoders of another process, see vjmfc_export_counters () */
 static bool
-mfc_ctxt_setup_output_buffers (struct mfc_ctxt *ctxt)
+show_counters (const char *name)
 {
-	struct v4l2_format fmt;
-	if (v4l2_mfc_g_fmt (ctxt->handler, &fmt) != 0) {
-		perror ("Couldn't set format: ");
+	int fd;
+	struct stat st;
+	const uint8_t *p;
+	const struct vjmfc_counters_header *h;
+	struct vjmfc_counters c;
+	unsigned int i, live = 0;
+	bool ok = false;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf (stderr, "Couldn't open %s: %s\n", name,
+			 strerror (errno));
 		return false;
 	}
 
-	if (!prepare_buffers (ctxt, OUT))
-		return false;
-
-	if (!create_buffers (ctxt, OUT))
+	if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (*h)) {
+		fprintf (stderr, "%s holds no counters\n", name);
+		close (fd);
 		return false;
+	}
 
-	if (!queue_buffers (ctxt, OUT))
+	p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (p == MAP_FAILED) {
+		perror ("Couldn't map the counters: ");
 		return false;
-
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (v4l2_mfc_streamon (ctxt->handler, type) != 0) {
-		perror ("Couldn't set stream on: ");
-		return false;;
 	}
 
-	return true;
-}
-
-
-static bool
-mfc_ctxt_init (struct mfc_ctxt *ctxt)
-{
-	if (!mfc_ctxt_setup_input_buffers (ctxt))
-		return false;
+	h = (const struct vjmfc_counters_header *) p;
+	if (__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) != VJMFC_COUNTERS_MAGIC ||
+	    h->version != VJMFC_COUNTERS_VERSION ||
+	    h->slot_size < sizeof (c) ||
+	    (uint64_t) h->slot_size * (h->slots + 1) > (uint64_t) st.st_size) {
+		fprintf (stderr, "%s holds no counters\n", name);
+		goto out;
+	}
 
-	if (!mfc_ctxt_setup_output_buffers (ctxt))
-		return false;
+	printf ("> decoders of process %u\n", h->pid);
+	for (i = 0; i < h->slots; i++) {
+		vjmfc_read_counters ((const struct vjmfc_counters *)
+				     (p + (size_t) h->slot_size * (i + 1)), &c);
+		if (c.in_use != 1)
+			continue;
+		print_counters (i, &c);
+		live++;
+	}
+	if (live == 0)
+		printf ("> none running\n");
+	ok = true;
 
-	return true;
+out:
+	munmap ((void *) p, st.st_size);
+	return ok;
 }
 
-static bool
-mfc_ctxt_deinit (struct mfc_ctxt *ctxt)
+static void
+usage (const char *prog)
 {
-	return true;
+	fprintf (stderr,
+		 "Usage: %s [options] <video>...\n"
+		 "With several videos, all of them are decoded at once.\n"
+		 "  -C, --concat             decode several videos one after the\n"
+		 "                           other, on one decoder\n"
+		 "  -t, --threaded           decode with parser and display threads\n"
+		 "  -p, --preset=NAME        queue depths: latency, default or throughput\n"
+		 "  -i, --output-buffers=N   number of compressed (OUTPUT) buffers\n"
+		 "  -e, --capture-extra=N    CAPTURE buffers beyond the driver minimum\n"
+		 "  -d, --dmabuf             export CAPTURE buffers as dmabufs, no mmap\n"
+		 "  -u, --userptr            back OUTPUT buffers with our own memory\n"
+		 "  -B, --batch              pack several frames per OUTPUT buffer\n"
+		 "                           (frame timestamps are per buffer)\n"
+		 "  -A, --adaptive           add frame buffers while the consumer holds\n"
+		 "                           too many\n"
+		 "  -R, --read-ahead=N[,MIB] demux up to N packets (and MIB, default 16)\n"
+		 "                           ahead from another thread\n"
+		 "  -l, --low-latency        no display delay, minimal queues; reports\n"
+		 "                           the per-frame latency\n"
+		 "  -b, --bench[=FORMAT]     report fps, latency, queue depth and cpu use\n"
+		 "                           as text (default), csv or json\n"
+		 "  -a, --async              decode from a poll loop through the\n"
+		 "                           asynchronous API\n"
+		 "  -s, --seek=PTS           start at this timestamp (frame number for\n"
+		 "                           raw streams)\n"
+		 "  -k, --thumbnails=DIR     decode only keyframes and write them to DIR\n"
+		 "  -I, --interval=SEC       at most one thumbnail every SEC seconds\n"
+		 "  -F, --format=FMT         convert thumbnails to nv12, i420 or rgb\n"
+		 "                           (default: as decoded)\n"
+		 "  -w, --write=FILE         write the raw frames to FILE (- for stdout)\n"
+		 "  -c, --checksums=FILE     write a CRC-32C per frame to FILE\n"
+		 "  -o, --transcode=FILE     re-encode on the MFC into FILE (H.264)\n"
+		 "  -r, --bitrate=BPS        encoder bitrate\n"
+		 "  -g, --gop=N              frames between encoded keyframes\n"
+		 "  -P, --profile=N          encoder profile, a V4L2 profile value\n"
+		 "  -S, --startup-profile    report where the time to the first frame\n"
+		 "                           went\n"
+		 "  -T, --trace=FILE         write a Chrome trace of the ioctls (needs\n"
+		 "                           a TRACE=1 build)\n"
+		 "  -X, --export-stats=NAME  keep live counters in the shared memory\n"
+		 "                           object NAME (/dev/shm/NAME)\n"
+		 "  -x, --show-stats=NAME    print the counters another run exports\n"
+		 "                           to NAME, and exit\n"
+		 "  -h, --help               show this help\n",
+		 prog);
 }
 
 int
 main (int argc, char **argv)
 {
-	int ret = EXIT_FAILURE;
+	int c, ret = EXIT_FAILURE;
+	bool bench = false, async = false, startup = false, concat = false;
+	const char *trace = NULL, *thumbs = NULL, *transcode = NULL;
+	const char *raw = NULL, *sums = NULL;
+	const char *exported = NULL, *shown = NULL;
+	unsigned long value;
+	char *end;
+	long long seek = -1;
+	enum bench_format format = BENCH_TEXT;
+	uint32_t count, frames = 0;
+	struct bench stats;
+	struct thumb thumb;
+	struct sink sink;
+	bool convert = false;
+	enum vjmfc_pixfmt pixfmt = VJMFC_PIXFMT_NV12;
+	struct vjmfc_stats info;
+	struct vjmfc *dec;
+	double start;
+	struct vjmfc_params params;
+	struct vjmfc_enc_params enc;
+	static const struct option opts[] = {
+		{ "threaded", no_argument, NULL, 't' },
+		{ "concat", no_argument, NULL, 'C' },
+		{ "preset", required_argument, NULL, 'p' },
+		{ "output-buffers", required_argument, NULL, 'i' },
+		{ "capture-extra", required_argument, NULL, 'e' },
+		{ "dmabuf", no_argument, NULL, 'd' },
+		{ "userptr", no_argument, NULL, 'u' },
+		{ "batch", no_argument, NULL, 'B' },
+		{ "low-latency", no_argument, NULL, 'l' },
+		{ "adaptive", no_argument, NULL, 'A' },
+		{ "read-ahead", required_argument, NULL, 'R' },
+		{ "bench", optional_argument, NULL, 'b' },
+		{ "async", no_argument, NULL, 'a' },
+		{ "seek", required_argument, NULL, 's' },
+		{ "thumbnails", required_argument, NULL, 'k' },
+		{ "interval", required_argument, NULL, 'I' },
+		{ "format", required_argument, NULL, 'F' },
+		{ "write", required_argument, NULL, 'w' },
+		{ "checksums", required_argument, NULL, 'c' },
+		{ "transcode", required_argument, NULL, 'o' },
+		{ "bitrate", required_argument, NULL, 'r' },
+		{ "gop", required_argument, NULL, 'g' },
+		{ "profile", required_argument, NULL, 'P' },
+		{ "startup-profile", no_argument, NULL, 'S' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "export-stats", required_argument, NULL, 'X' },
+		{ "show-stats", required_argument, NULL, 'x' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	vjmfc_params_init (&params);
+	vjmfc_enc_params_init (&enc);
+
+	while ((c = getopt_long (argc, argv, "tCp:i:e:duBlAR:b::as:k:I:F:w:c:o:r:g:P:ST:X:x:h", opts, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			params.threaded = true;
+			break;
+		case 'C':
+			concat = true;
+			break;
+		case 'p':
+			if (!parse_preset (optarg, &params.preset)) {
+				fprintf (stderr, "Unknown preset: %s\n", optarg);
+				return ret;
+			}
+			break;
+		case 'i':
+			if (!parse_count (optarg, &count) || count == 0) {
+				fprintf (stderr, "Invalid buffer count: %s\n", optarg);
+				return ret;
+			}
+			params.output_buffers = count;
+			break;
+		case 'e':
+			if (!parse_count (optarg, &count)) {
+				fprintf (stderr, "Invalid buffer count: %s\n", optarg);
+				return ret;
+			}
+			params.capture_extra = count;
+			break;
+		case 'd':
+			params.export_dmabuf = true;
+			break;
+		case 'u':
+			params.input_memory = VJMFC_MEMORY_USERPTR;
+			break;
+		case 'B':
+			params.batch = true;
+			break;
+		case 'l':
+			/* the latency is the point, so measure it */
+			params.low_latency = true;
+			bench = true;
+			break;
+		case 'A':
+			params.adaptive = true;
+			break;
+		case 'R':
+			if (!parse_read_ahead (optarg, &params)) {
+				fprintf (stderr, "Invalid read-ahead: %s\n", optarg);
+				return ret;
+			}
+			break;
+		case 'b':
+			if (!parse_bench (optarg, &format)) {
+				fprintf (stderr, "Unknown bench format: %s\n",
+					 optarg);
+				return ret;
+			}
+			bench = true;
+			break;
+		case 'a':
+			async = true;
+			break;
+		case 's':
+			seek = strtoll (optarg, &end, 10);
+			if (*end != '\0' || seek < 0) {
+				fprintf (stderr, "Invalid timestamp: %s\n", optarg);
+				return ret;
+			}
+			break;
+		case 'k':
+			thumbs = optarg;
+			params.keyframes_only = true;
+			break;
+		case 'I':
+			params.keyframe_interval = strtod (optarg, &end);
+			if (*end != '\0' || params.keyframe_interval < 0) {
+				fprintf (stderr, "Invalid interval: %s\n", optarg);
+				return ret;
+			}
+			break;
+		case 'F':
+			if (!parse_format (optarg, &pixfmt)) {
+				fprintf (stderr, "Unknown format: %s\n", optarg);
+				return ret;
+			}
+			convert = true;
+			break;
+		case 'w':
+			raw = optarg;
+			break;
+		case 'c':
+			sums = optarg;
+			break;
+		case 'o':
+			transcode = optarg;
+			/* the encoder imports the decoded frames */
+			params.export_dmabuf = true;
+			break;
+		case 'r':
+		case 'g':
+		case 'P':
+			errno = 0;
+			value = strtoul (optarg, &end, 10);
+			if (errno || *end != '\0' || value > UINT32_MAX) {
+				fprintf (stderr, "Invalid value: %s\n", optarg);
+				return ret;
+			}
+			if (c == 'r')
+				enc.bitrate = value;
+			else if (c == 'g')
+				enc.gop = value;
+			else
+				enc.profile = value;
+			break;
+		case 'S':
+			startup = true;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'X':
+			exported = optarg;
+			break;
+		case 'x':
+			shown = optarg;
+			break;
+		case 'h':
+			usage (argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage (argv[0]);
+			return ret;
+		}
+	}
+
+	if (shown)
+		return show_counters (shown) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-	if (argc != 2) {
+	if (optind >= argc) {
 		fprintf (stderr, "Missing video path argument.\n");
+		usage (argv[0]);
 		return ret;
 	}
 
-	struct mfc_ctxt *ctxt = mfc_ctxt_new ();
-	if (!mfc_ctxt_open (ctxt, argv[1])) {
-		perror ("Couldn't open input file: ");
-		goto bail;
+	/* every frame of a batch reports the first one's latency */
+	if (bench && params.batch) {
+		fprintf (stderr, "Batching can't be benchmarked per frame.\n");
+		return ret;
 	}
 
-	if (!mfc_ctxt_init (ctxt))
-		goto bail;
+	if (thumbs && transcode) {
+		fprintf (stderr, "Can't thumbnail and transcode at once.\n");
+		return ret;
+	}
 
+	if ((raw || sums) && (thumbs || transcode)) {
+		fprintf (stderr, "Frames can't be written while thumbnailing "
+			 "or transcoding.\n");
+		return ret;
+	}
 
-	ret = EXIT_SUCCESS;
+	if ((thumbs || raw || sums) && params.export_dmabuf) {
+		fprintf (stderr, "Writing frames needs them mapped.\n");
+		return ret;
+	}
 
-bail:
-	mfc_ctxt_close (ctxt);
-	mfc_ctxt_deinit (ctxt);
-	mfc_ctxt_free (ctxt);
+	if (exported) {
+		c = vjmfc_export_counters (exported);
+		if (c != 0) {
+			fprintf (stderr, "Couldn't export the counters to %s: %s\n",
+				 exported, strerror (-c));
+			return ret;
+		}
+	}
+
+	if (argc - optind > 1) {
+		if (params.threaded || bench || thumbs || transcode ||
+		    raw || sums || async) {
+			fprintf (stderr, "Several videos can only be decoded.\n");
+			return ret;
+		}
+		if (concat)
+			ret = decode_concat (&argv[optind], argc - optind,
+					     &params);
+		else
+			ret = decode_many (&argv[optind], argc - optind,
+					   &params);
+		goto out;
+	}
+
+	/* before the decoder, which logs to stdout */
+	if ((raw || sums) && !sink_open (&sink, raw, sums))
+		goto out;
+
+	dec = vjmfc_open (argv[optind], &params);
+	if (!dec) {
+		perror ("Couldn't open input file: ");
+		goto done;
+	}
+
+	if (seek >= 0 && vjmfc_seek (dec, seek) != 0) {
+		fprintf (stderr, "Couldn't seek to %lld\n", seek);
+		vjmfc_close (dec);
+		goto done;
+	}
+
+	if (transcode) {
+		start = now ();
+		c = vjmfc_transcode (dec, transcode, &enc);
+		if (c == 0) {
+			vjmfc_get_stats (dec, &info);
+			printf ("> transcoded %llu frames to %s\n",
+				(unsigned long long) info.frames, transcode);
+			report (info.frames, now () - start);
+			ret = EXIT_SUCCESS;
+		} else {
+			fprintf (stderr, "Couldn't transcode: %s\n",
+				 strerror (-c));
+		}
+	} else if (thumbs) {
+		thumb_start (&thumb, thumbs);
+		thumb.convert = convert;
+		thumb.format = pixfmt;
+		if (vjmfc_decode (dec, thumb_frame, &thumb) == 0 &&
+		    thumb.failed == 0) {
+			printf ("> wrote %u thumbnails to %s\n", thumb.frames,
+				thumbs);
+			ret = EXIT_SUCCESS;
+		}
+	} else if (bench) {
+		bench_start (&stats, argv[optind], format);
+		if (raw || sums)
+			stats.sink = &sink;
+		if (vjmfc_decode (dec, bench_frame, &stats) == 0) {
+			bench_report (&stats, dec);
+			ret = EXIT_SUCCESS;
+		}
+	} else if (async) {
+		start = now ();
+		if (decode_async (dec, &frames)) {
+			printf ("> decoded %u frames\n", frames);
+			report (frames, now () - start);
+			ret = EXIT_SUCCESS;
+		}
+	} else if (raw || sums) {
+		start = now ();
+		if (vjmfc_decode (dec, sink_frame, &sink) == 0) {
+			printf ("> wrote %u frames\n", sink.frames);
+			report (sink.frames, now () - start);
+			ret = EXIT_SUCCESS;
+		}
+	} else {
+		start = now ();
+		if (vjmfc_decode (dec, count_frame, &frames) == 0) {
+			printf ("> decoded %u frames\n", frames);
+			report (frames, now () - start);
+			ret = EXIT_SUCCESS;
+		}
+	}
+
+	if (startup)
+		report_startup (dec);
+	vjmfc_close (dec);
+
+	/* the callbacks may run until the decoder is closed */
+	if (thumbs)
+		thumb_free (&thumb);
+	else if (bench && !transcode)
+		bench_free (&stats);
+
+done:
+	/* a frame that couldn't be written fails the run */
+	if ((raw || sums) && !sink_close (&sink))
+		ret = EXIT_FAILURE;
+
+out:
+	if (trace)
+		write_trace (trace);
+	if (exported)
+		shm_unlink (exported);
 	return ret;
 }
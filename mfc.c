@@ -0,0 +1,1783 @@
+/*******************************************************************************
+ * ==============================
+ * Decoding initialization path
+ * ==============================
+ *
+ * First the OUTPUT queue is initialized. With S_FMT the application
+ * chooses which video format to decode and what size should be the
+ * input buffer. Fourcc values have been defined for different codecs
+ * e.g.  V4L2_PIX_FMT_H264 for h264. Then the OUTPUT buffers are
+ * requested and mmaped. The stream header frame is loaded into the
+ * first buffer, queued and streaming is enabled. At this point the
+ * hardware is able to start processing the stream header and
+ * afterwards it will have information about the video dimensions and
+ * the size of the buffers with raw video data.
+ *
+ * The next step is setting up the CAPTURE queue and buffers. The
+ * width, height, buffer size and minimum number of buffers can be
+ * read with G_FMT call. The application can request more output
+ * buffer if necessary. After requesting and mmaping buffers the
+ * device is ready to decode video stream.
+ *
+ * The stream frames (ES frames) are written to the OUTPUT buffers,
+ * and decoded video frames can be read from the CAPTURE buffers. When
+ * no more source frames are present a single buffer with bytesused
+ * set to 0 should be queued. This will inform the driver that
+ * processing should be finished and it can dequeue all video frames
+ * that are still left. The number of such frames is dependent on the
+ * stream and its internal structure (how many frames had to be kept
+ * as reference frames for decoding, etc).
+ *
+ * ===============
+ *  Usage summary
+ * ===============
+ *
+ * This is a step by step summary of the video decoding (from user
+ * application point of view, with 2 treads and blocking api):
+ *
+ * 01. S_FMT(OUTPUT, V4L2_PIX_FMT_H264, ...)
+ * 02. REQ_BUFS(OUTPUT, n)
+ * 03. for i=1..n MMAP(OUTPUT, i)
+ * 04. put stream header to buffer #1
+ * 05. QBUF(OUTPUT, #1)
+ * 06. STREAM_ON(OUTPUT)
+ * 07. G_FMT(CAPTURE)
+ * 08. REQ_BUFS(CAPTURE, m)
+ * 09. for j=1..m MMAP(CAPTURE, j)
+ * 10. for j=1..m QBUF(CAPTURE, #j)
+ * 11. STREAM_ON(CAPTURE)
+ *
+ * display thread:
+ * 12. DQBUF(CAPTURE) -> got decoded video data in buffer #j
+ * 13. display buffer #j
+ * 14. QBUF(CAPTURE, #j)
+ * 15. goto 12
+ *
+ * parser thread:
+ * 16. put next ES frame to buffer #i
+ * 17. QBUF(OUTPUT, #i)
+ * 18. DQBUF(OUTPUT) -> get next empty buffer #i 19. goto 16
+ *
+ * ...
+ *
+ * Similar usage sequence can be achieved with single threaded
+ * application and non-blocking api with poll() call.
+ *
+ * https://lwn.net/Articles/419695/
+ ******************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "mfc.h"
+#include "dev.h"
+
+/* queue depth presets: fewer buffers means less latency */
+struct mfc_preset {
+	uint32_t in_count, out_extra;
+};
+
+static const struct mfc_preset presets[] = {
+	[VJMFC_PRESET_DEFAULT] = { 4, 2 },
+	[VJMFC_PRESET_LATENCY] = { 1, 0 },
+	[VJMFC_PRESET_THROUGHPUT] = { 8, 4 },
+};
+
+/* the MFC uses this when the driver can't tell the minimum */
+#define MIN_CAPTURE_BUFFERS 2
+
+/*
+ * Adaptive CAPTURE depth: over every window of decoded frames, count
+ * the ones after which the driver was left with nothing but reference
+ * frames to decode into. The consumer holds the rest, so give the
+ * driver more, up to ADAPT_MAX_GROWTH beyond the initial count.
+ */
+#define ADAPT_WINDOW 32
+#define ADAPT_STARVED 4
+#define ADAPT_STEP 2
+#define ADAPT_MAX_GROWTH 8
+
+/* sizeimage when batching: room for this many average frames */
+#define BATCH_FRAMES 16
+#define MIN_BATCH_SIZE (128 * 1024)
+#define DEFAULT_IN_SIZE (1024 * 3072)
+
+struct mfc_ctxt *
+mfc_ctxt_new (void)
+{
+	struct mfc_ctxt *ctxt = calloc (1, sizeof (struct mfc_ctxt));
+	if (!ctxt)
+		return NULL;
+
+	if (!arena_init (&ctxt->arena, MFC_ARENA_SIZE)) {
+		free (ctxt);
+		return NULL;
+	}
+
+	ctxt->handler = -1;
+	mfc_ctxt_set_preset (ctxt, VJMFC_PRESET_DEFAULT);
+	ctxt->in_memory = V4L2_MEMORY_MMAP;
+	ctxt->in_size = DEFAULT_IN_SIZE;
+	ctxt->filled_efd = -1;
+	ctxt->released_efd = -1;
+	ctxt->async_fd = -1;
+	ctxt->kick_efd = -1;
+
+	ctxt->cnt = counters_claim ();
+	if (!ctxt->cnt) {
+		ctxt->cnt = &ctxt->own;
+		ctxt->own.opened = now_ns ();
+	}
+	return ctxt;
+}
+
+bool
+mfc_ctxt_set_preset (struct mfc_ctxt *ctxt, enum vjmfc_preset preset)
+{
+	if ((unsigned) preset >= sizeof (presets) / sizeof (presets[0]))
+		return false;
+
+	ctxt->in_count = presets[preset].in_count;
+	ctxt->out_extra = presets[preset].out_extra;
+	return true;
+}
+
+bool
+mfc_ctxt_open_device (struct mfc_ctxt *ctxt)
+{
+	/* decoders opened from a codec start here */
+	if (!ctxt->startup.start)
+		ctxt->startup.start = now_ns ();
+
+	ctxt->handler = v4l2_open_device (MFC_DEC_DRIVER, &ctxt->node);
+	if (ctxt->handler < 0)
+		return false;
+	ctxt->opened = now_ns ();
+
+	/* without events we rely on G_FMT blocking until the header is parsed */
+	ctxt->events = v4l2_mfc_subscribe_event (ctxt->handler,
+						 V4L2_EVENT_SOURCE_CHANGE) == 0;
+
+	/* older drivers drain on an empty buffer and restart on STREAMOFF */
+	ctxt->dec_stop = v4l2_mfc_decoder_cmd (ctxt->handler,
+					       V4L2_DEC_CMD_STOP, true) == 0;
+	ctxt->dec_start = v4l2_mfc_decoder_cmd (ctxt->handler,
+						V4L2_DEC_CMD_START, true) == 0;
+	ctxt->last_index = -1;
+
+	return true;
+}
+
+/* fit sizeimage to the stream, the default is way too big to batch */
+static void
+size_batches (struct mfc_ctxt *ctxt)
+{
+	uint64_t size;
+	uint32_t frame;
+
+	if (ctxt->codec == V4L2_PIX_FMT_H264) {
+		fprintf (stderr, "H.264 takes one frame per buffer, not batching\n");
+		ctxt->batch = false;
+		return;
+	}
+
+	frame = ctxt->es.data ? es_frame_size (&ctxt->es) :
+		get_frame_size (ctxt->fc);
+	if (frame == 0)
+		return;
+
+	size = (uint64_t) frame * BATCH_FRAMES;
+	if (size < MIN_BATCH_SIZE)
+		size = MIN_BATCH_SIZE;
+	if (size > DEFAULT_IN_SIZE)
+		size = DEFAULT_IN_SIZE;
+
+	/* the pool rounds it to pages for USERPTR */
+	ctxt->in_size = size;
+}
+
+/* header is the codec configuration, it may come back converted */
+bool
+mfc_ctxt_set_codec (struct mfc_ctxt *ctxt,
+		    uint32_t codec,
+		    const uint8_t *header,
+		    uint32_t size)
+{
+	if (!packetizer_init (&ctxt->pz, codec, header, size))
+		return false;
+
+	ctxt->codec = codec;
+	counter_set (&ctxt->cnt->fourcc, codec);
+	ctxt->header = ctxt->pz.header ? ctxt->pz.header : header;
+	ctxt->header_size = ctxt->pz.header ? ctxt->pz.header_size : size;
+
+	if (ctxt->pz.header)
+		printf ("> packets go through the %s packetizer\n",
+			ctxt->pz.ops->name);
+	return true;
+}
+
+static bool alloc_input_buffers (struct mfc_ctxt *ctxt);
+
+/*
+ * The device is found, opened and given its OUTPUT buffers here while
+ * libavformat probes the streams; none of it touches the demuxer.
+ */
+static void *
+startup_thread (void *data)
+{
+	struct mfc_ctxt *ctxt = data;
+	uint64_t t = now_ns ();
+
+	ctxt->startup_ok = mfc_ctxt_open_device (ctxt);
+	ctxt->startup.device = now_ns () - t;
+
+	if (ctxt->startup_ok && ctxt->codec != 0) {
+		t = now_ns ();
+		ctxt->startup_ok = alloc_input_buffers (ctxt);
+		ctxt->startup.buffers = now_ns () - t;
+	}
+
+	return NULL;
+}
+
+static bool
+open_demuxed (struct mfc_ctxt *ctxt, const char *filename)
+{
+	int size;
+	uint32_t codec;
+	const uint8_t *header;
+	pthread_t thread;
+	bool started = false, probed, restart = ctxt->handler != -1;
+
+	ctxt->fc = av_context_open (filename);
+	if (!ctxt->fc)
+		return false;
+	av_init_packet (&ctxt->pkt);
+
+	/*
+	 * Containers mostly name the codec in their header already. The
+	 * buffers wait for the batch size when batching, which needs the
+	 * bitrate from the probe. Restarts have all of it already.
+	 */
+	if (!restart) {
+		ctxt->startup.probed = now_ns ();
+		ctxt->codec = ctxt->batch ? 0 : get_codec_id (ctxt->fc);
+		started = pthread_create (&thread, NULL, startup_thread,
+					  ctxt) == 0;
+		if (!started)
+			startup_thread (ctxt);
+	}
+
+	probed = av_context_probe (ctxt->fc);
+	if (!restart)
+		ctxt->startup.info = now_ns ();
+
+	if (started)
+		pthread_join (thread, NULL);
+	if (!probed || (!restart && !ctxt->startup_ok))
+		return false;
+
+	/* the OUTPUT format is set for good once the buffers are there */
+	codec = get_codec_id (ctxt->fc);
+	if (codec == 0) {
+		fprintf (stderr, "Couldn't recognize the codec\n");
+		return false;
+	}
+
+	if (ctxt->in_ready && codec != ctxt->codec) {
+		fprintf (stderr, "The stream's codec doesn't match the decoder's\n");
+		return false;
+	}
+
+	header = get_codec_extradata (ctxt->fc, &size);
+	if (!mfc_ctxt_set_codec (ctxt, codec, header, (size > 0) ? size : 0)) {
+		fprintf (stderr, "Invalid codec configuration\n");
+		return false;
+	}
+
+	return true;
+}
+
+/* a raw stream or a demuxed file, with the read-ahead if there's one */
+static bool
+open_source (struct mfc_ctxt *ctxt, const char *filename)
+{
+	/* raw streams skip libavformat and its probing altogether */
+	if (es_open (&ctxt->es, filename)) {
+		if (ctxt->in_ready && ctxt->es.codec != ctxt->codec) {
+			fprintf (stderr, "The stream's codec doesn't match the decoder's\n");
+			return false;
+		}
+
+		return mfc_ctxt_set_codec (ctxt,
+					   ctxt->es.codec,
+					   ctxt->es.data,
+					   ctxt->es.header_size);
+	}
+
+	if (!open_demuxed (ctxt, filename))
+		return false;
+
+	/* from here on the demuxer belongs to the read-ahead */
+	if (ctxt->read_ahead > 0 &&
+	    (!prefetch_open (&ctxt->prefetch,
+			     ctxt->fc,
+			     filename,
+			     ctxt->read_ahead,
+			     ctxt->read_ahead_bytes) ||
+	     !prefetch_start (&ctxt->prefetch)))
+		return false;
+
+	return true;
+}
+
+static void
+close_source (struct mfc_ctxt *ctxt)
+{
+	prefetch_close (&ctxt->prefetch);
+	if (ctxt->pkt_pending) {
+		av_packet_unref (&ctxt->pkt);
+		ctxt->pkt_pending = false;
+	}
+	if (ctxt->fc)
+		av_context_free (&ctxt->fc);
+	es_close (&ctxt->es);
+}
+
+bool
+mfc_ctxt_open (struct mfc_ctxt *ctxt, const char *filename)
+{
+	ctxt->startup.start = now_ns ();
+
+	if (!open_source (ctxt, filename))
+		return false;
+
+	/* the buffers waited for this when batching */
+	if (ctxt->batch)
+		size_batches (ctxt);
+
+	/* demuxed files got their device while probing */
+	return ctxt->handler != -1 || mfc_ctxt_open_device (ctxt);
+}
+
+void
+mfc_ctxt_close (struct mfc_ctxt *ctxt)
+{
+	double elapsed;
+
+	close_source (ctxt);
+
+	/* the frame rate it got helps placing the next streams */
+	if (ctxt->handler != -1) {
+		elapsed = (now_ns () - ctxt->opened) / 1e9;
+		v4l2_release_device (ctxt->handler,
+				     ctxt->node,
+				     elapsed > 0 ? ctxt->frames / elapsed : 0);
+		ctxt->handler = -1;
+	}
+}
+
+static void
+unmap_buffers (struct mfc_ctxt *ctxt, enum dir d)
+{
+	int res;
+	uint32_t i, j, c;
+	struct mfc_buffer *b;
+
+	c = (d == IN) ? ctxt->ic : ctxt->oc;
+	b = (d == IN) ? ctxt->in : ctxt->out;
+
+	/* pool memory isn't a mapping */
+	if (d == IN && ctxt->in_memory != V4L2_MEMORY_MMAP)
+		return;
+
+	for (i = 0; i < c; i++) {
+		for (j = 0; j < b[i].buf.length; j++) {
+			if (b[i].paddr[j] && b[i].paddr[j] != MAP_FAILED) {
+				res = munmap (b[i].paddr[j], b[i].planes[j].length);
+				if (res != 0)
+					perror ("Couldn't unmap a plane");
+				else
+					counter_add (&ctxt->cnt->mapped,
+						     -(uint64_t) b[i].planes[j].length);
+			}
+			if (b[i].dmabuf[j] != -1)
+				close (b[i].dmabuf[j]);
+		}
+	}
+}
+
+void
+mfc_ctxt_free (struct mfc_ctxt *ctxt)
+{
+	unmap_buffers (ctxt, IN);
+	unmap_buffers (ctxt, OUT);
+	arena_destroy (&ctxt->arena);
+	free (ctxt->in_pool);
+	ring_destroy (&ctxt->filled);
+	ring_destroy (&ctxt->released);
+	if (ctxt->filled_efd != -1)
+		close (ctxt->filled_efd);
+	if (ctxt->released_efd != -1)
+		close (ctxt->released_efd);
+	mfc_ctxt_async_close (ctxt);
+	packetizer_free (&ctxt->pz);
+	if (ctxt->cnt != &ctxt->own)
+		counters_release (ctxt->cnt);
+	free (ctxt);
+}
+
+inline static bool
+map_planes (struct mfc_ctxt *ctxt, struct mfc_buffer *b)
+{
+	uint32_t i;
+	struct v4l2_buffer *buf = &b->buf;
+
+	for (i = 0; i < buf->length; i++) {
+		if (buf->m.planes[i].length == 0)
+			continue;
+
+		b->paddr[i] = mmap (NULL,
+				    buf->m.planes[i].length,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED,
+				    ctxt->handler,
+				    buf->m.planes[i].m.mem_offset);
+
+		if (b->paddr[i] == MAP_FAILED)
+			return false;
+		counter_add (&ctxt->cnt->mapped, buf->m.planes[i].length);
+
+		memset (b->paddr[i], 0, buf->m.planes[i].length);
+	}
+
+	return true;
+}
+
+static bool
+export_planes (int fd, struct mfc_buffer *b)
+{
+	uint32_t i;
+	struct v4l2_buffer *buf = &b->buf;
+
+	for (i = 0; i < buf->length; i++) {
+		if (v4l2_mfc_expbuf (fd,
+				     buf->type,
+				     buf->index,
+				     i,
+				     &b->dmabuf[i]) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+attach_pool (struct mfc_ctxt *ctxt)
+{
+	uint32_t i;
+	long page = sysconf (_SC_PAGESIZE);
+
+	/* the driver wants every user buffer to hold a full sizeimage */
+	ctxt->in_size = (ctxt->in_size + page - 1) & ~(page - 1);
+	if (posix_memalign ((void **) &ctxt->in_pool,
+			    page,
+			    (size_t) ctxt->in_size * ctxt->ic) != 0)
+		return false;
+
+	for (i = 0; i < ctxt->ic; i++) {
+		struct mfc_buffer *b = &ctxt->in[i];
+
+		b->paddr[0] = ctxt->in_pool + (size_t) i * ctxt->in_size;
+		b->planes[0].m.userptr = (unsigned long) b->paddr[0];
+		b->planes[0].length = ctxt->in_size;
+	}
+
+	return true;
+}
+
+static bool
+create_buffer (struct mfc_ctxt *ctxt, enum dir d, uint32_t i)
+{
+	struct mfc_buffer *b = (d == IN) ? &ctxt->in[i] : &ctxt->out[i];
+	enum v4l2_buf_type type = (d == IN) ?
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE :
+		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	enum v4l2_memory memory = (d == IN) ?
+		ctxt->in_memory : V4L2_MEMORY_MMAP;
+
+	if (v4l2_mfc_querybuf (ctxt->handler,
+			       i,
+			       type,
+			       memory,
+			       b->planes,
+			       &b->buf) != 0) {
+		perror ("query buffers failed: ");
+		return false;
+	}
+
+	printf ("> %s buffer %d has %d plane(s)\n",
+		(d == IN) ? "input" : "output", i, b->buf.length);
+	assert (b->buf.length <= 2);
+
+	/* user memory is attached below or at QBUF time */
+	if (memory != V4L2_MEMORY_MMAP)
+		return true;
+
+	/* exported frames never need a CPU mapping */
+	if (d == OUT && ctxt->export_dmabuf) {
+		if (!export_planes (ctxt->handler, b)) {
+			perror ("exporting buffers failed: ");
+			return false;
+		}
+		return true;
+	}
+
+	if (!map_planes (ctxt, b)) {
+		perror ("mapping buffers failed: ");
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+create_buffers (struct mfc_ctxt *ctxt, enum dir d)
+{
+	uint32_t i, c;
+
+	c = (d == IN) ? ctxt->ic : ctxt->oc;
+
+	for (i = 0; i < c; i++) {
+		if (!create_buffer (ctxt, d, i))
+			return false;
+	}
+
+	if (d == IN && ctxt->in_memory == V4L2_MEMORY_USERPTR &&
+	    !attach_pool (ctxt)) {
+		perror ("allocating input pool failed: ");
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+queue_buffers (struct mfc_ctxt *ctxt, enum dir d)
+{
+	uint32_t i, c;
+	struct mfc_buffer *b;
+
+	c = (d == IN) ? ctxt->ic : ctxt->oc;
+	b = (d == IN) ? ctxt->in : ctxt->out;
+
+	for (i = 0; i < c; i++) {
+		if (v4l2_mfc_qbuf (ctxt->handler, &b[i].buf) != 0) {
+			perror ("Couldn't queue buffers: ");
+			return false;
+		}
+	}
+
+	if (d == OUT)
+		ctxt->out_queued = c;
+
+	return true;
+}
+
+static void
+stamp_input (struct mfc_ctxt *ctxt, struct mfc_buffer *b, int64_t pts)
+{
+	uint32_t seq = ctxt->seq++;
+	struct mfc_stamp *s = &ctxt->stamps[seq % MFC_STAMPS];
+
+	s->pts = pts;
+	s->queued = now_ns ();
+
+	counter_add (&ctxt->cnt->packets, 1);
+	counter_add (&ctxt->cnt->bytes, b->planes[0].bytesused);
+
+	b->buf.timestamp.tv_sec = seq / 1000000;
+	b->buf.timestamp.tv_usec = seq % 1000000;
+}
+
+static inline struct mfc_stamp *
+get_stamp (struct mfc_ctxt *ctxt, const struct v4l2_buffer *buf)
+{
+	uint64_t seq = (uint64_t) buf->timestamp.tv_sec * 1000000 +
+		buf->timestamp.tv_usec;
+
+	return &ctxt->stamps[seq % MFC_STAMPS];
+}
+
+/* false when the packet was dropped: unconvertible, or too big */
+static bool
+copy_packet (struct mfc_ctxt *ctxt,
+	     struct mfc_buffer *b,
+	     const uint8_t *data,
+	     uint32_t size,
+	     bool key)
+{
+	size_t n = packetizer_write (&ctxt->pz,
+				     b->paddr[0],
+				     b->planes[0].length,
+				     data,
+				     size,
+				     key);
+
+	/*
+	 * Neither unconverted bytes nor a truncated packet are any good
+	 * to the MFC; copying only fails on size.
+	 */
+	if (n == 0) {
+		if (ctxt->pz.ops->converts)
+			fprintf (stderr, "Couldn't convert a packet (%u bytes), "
+				 "dropping it\n", size);
+		else
+			fprintf (stderr, "Packet too big (%u bytes), dropping it\n",
+				 size);
+		counter_add (&ctxt->cnt->dropped, 1);
+		return false;
+	}
+
+	b->planes[0].bytesused = n;
+	return true;
+}
+
+/* only demuxed packets are flagged, raw streams carry their headers */
+static inline bool
+au_is_key (struct mfc_ctxt *ctxt)
+{
+	return !ctxt->es.data && ctxt->pkt.flags & AV_PKT_FLAG_KEY;
+}
+
+/* nothing depends on a keyframe, so any of them can be left out */
+static bool
+wanted_key (struct mfc_ctxt *ctxt, const AVPacket *pkt)
+{
+	double t;
+
+	if (!(pkt->flags & AV_PKT_FLAG_KEY))
+		return false;
+
+	t = get_packet_time (ctxt->fc, pkt);
+	if (isnan (t))
+		return true;
+	if (t < ctxt->next_key)
+		return false;
+
+	ctxt->next_key = t + ctxt->key_interval;
+	return true;
+}
+
+/* the next access unit, from the elementary stream or the demuxer */
+static bool
+read_au (struct mfc_ctxt *ctxt, const uint8_t **au, size_t *size, int64_t *pts)
+{
+	AVPacket *pkt = &ctxt->pkt;
+
+	if (ctxt->es.data) {
+		do {
+			if (!es_next (&ctxt->es, au, size))
+				return false;
+		} while (ctxt->keyframes_only &&
+			 !es_is_key (&ctxt->es, *au, *size));
+
+		/* raw streams carry no timestamps, number the frames */
+		*pts = ctxt->es.frames - 1;
+		return true;
+	}
+
+	while (!ctxt->pkt_pending) {
+		if ((ctxt->prefetch.slots ?
+		     prefetch_read (&ctxt->prefetch, pkt) :
+		     av_read_video_packet (ctxt->fc, pkt)) < 0)
+			return false;
+		if (!ctxt->keyframes_only || wanted_key (ctxt, pkt))
+			break;
+		av_packet_unref (pkt);
+	}
+
+	ctxt->pkt_pending = true;
+	*au = pkt->data;
+	*size = pkt->size;
+	*pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+	return true;
+}
+
+/* done with the unit from read_au (), or keep it for the next buffer */
+static void
+release_au (struct mfc_ctxt *ctxt, size_t size, bool used)
+{
+	if (ctxt->es.data) {
+		if (!used)
+			es_unread (&ctxt->es, size);
+		return;
+	}
+
+	if (used) {
+		av_packet_unref (&ctxt->pkt);
+		ctxt->pkt_pending = false;
+	}
+}
+
+static bool
+fill_input_buffer (struct mfc_ctxt *ctxt, struct mfc_buffer *b, int64_t *pts)
+{
+	const uint8_t *au;
+	size_t size, n;
+	int64_t next;
+	uint32_t used, length = b->planes[0].length;
+	bool copied;
+
+	/* dropped packets can't leave the buffer empty, that's the end */
+	do {
+		if (!read_au (ctxt, &au, &size, pts)) {
+			/* an empty buffer tells the driver to drain what's left */
+			b->planes[0].bytesused = 0;
+			*pts = 0;
+			ctxt->eos = true;
+			return false;
+		}
+
+		copied = copy_packet (ctxt, b, au, size, au_is_key (ctxt));
+		release_au (ctxt, size, true);
+	} while (!copied);
+
+	/*
+	 * One stamp per buffer: the rest of the frames report the first
+	 * one's pts and latency. The header goes alone.
+	 */
+	used = b->planes[0].bytesused;
+	while (ctxt->batch && ctxt->capture_ready && used < length &&
+	       read_au (ctxt, &au, &size, &next)) {
+		n = packetizer_write (&ctxt->pz,
+				      (uint8_t *) b->paddr[0] + used,
+				      length - used,
+				      au,
+				      size,
+				      au_is_key (ctxt));
+		if (n == 0) {
+			release_au (ctxt, size, false);
+			break;
+		}
+
+		used += n;
+		release_au (ctxt, size, true);
+	}
+	b->planes[0].bytesused = used;
+
+	return true;
+}
+
+static bool
+fill_first_input_buffer (struct mfc_ctxt *ctxt, struct mfc_buffer *b)
+{
+	int64_t pts;
+
+	if (ctxt->header_size > 0) {
+		if (ctxt->header_size > b->planes[0].length)
+			return false;
+		memcpy (b->paddr[0], ctxt->header, ctxt->header_size);
+		b->planes[0].bytesused = ctxt->header_size;
+		return true;
+	}
+
+	/* no extradata: the header lives in the first frame */
+	if (mfc_ctxt_has_file (ctxt))
+		return fill_input_buffer (ctxt, b, &pts);
+
+	return false;
+}
+
+static bool
+prepare_buffers (struct mfc_ctxt *ctxt, enum dir d, uint32_t count)
+{
+	struct mfc_buffer *buf;
+	uint32_t i, n, requested = count;
+	enum v4l2_buf_type type = (d == IN) ?
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE :
+		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	enum v4l2_memory memory = (d == IN) ?
+		ctxt->in_memory : V4L2_MEMORY_MMAP;
+
+	if (v4l2_mfc_reqbufs (ctxt->handler,
+			      type,
+			      memory,
+			      &count) != 0) {
+		perror ("Couldn't request buffers: ");
+		return false;
+	}
+
+	if (count != requested)
+		printf ("> requested %u %s buffers, got %u\n", requested,
+			(d == IN) ? "input" : "output", count);
+
+	/* a new CAPTURE queue replaces the old one in the arena */
+	if (d == OUT)
+		arena_rewind (&ctxt->arena, ctxt->out_mark);
+
+	/* CAPTURE gets room for every buffer it may grow to */
+	n = (d == OUT && ctxt->adaptive) ? VIDEO_MAX_FRAME : count;
+	buf = arena_alloc (&ctxt->arena, n * sizeof (struct mfc_buffer));
+	if (!buf)
+		return false;
+	for (i = 0; i < n; i++)
+		buf[i].dmabuf[0] = buf[i].dmabuf[1] = -1;
+
+	if (d == IN) {
+		ctxt->ic = count;
+		ctxt->in = buf;
+		ctxt->in_free = arena_alloc (&ctxt->arena,
+					     count * sizeof (uint32_t));
+		if (!ctxt->in_free)
+			return false;
+		ctxt->out_mark = arena_mark (&ctxt->arena);
+	} else {
+		ctxt->oc = count;
+		ctxt->out = buf;
+	}
+
+	return true;
+}
+
+/* OUTPUT format and buffers: all it takes is the codec */
+static bool
+alloc_input_buffers (struct mfc_ctxt *ctxt)
+{
+	uint32_t i;
+
+	if (ctxt->codec == 0) {
+		perror ("Couldn't recognize the codec: ");
+		return false;
+	}
+
+	if (v4l2_mfc_s_fmt (ctxt->handler, ctxt->codec, ctxt->in_size) != 0) {
+		perror ("Couldn't set format: ");
+		return false;
+	}
+
+	if (!prepare_buffers (ctxt, IN, ctxt->in_count))
+		return false;
+
+	if (!create_buffers (ctxt, IN))
+		return false;
+
+	for (i = ctxt->ic; i > 0; i--)
+		ctxt->in_free[ctxt->nfree++] = i - 1;
+
+	ctxt->in_ready = true;
+	return true;
+}
+
+static bool
+mfc_ctxt_setup_input_buffers (struct mfc_ctxt *ctxt)
+{
+	struct mfc_buffer *b;
+
+	if (!ctxt->in_ready && !alloc_input_buffers (ctxt))
+		return false;
+
+	/* without a header the CAPTURE side waits for the first packet */
+	if (ctxt->in_memory != V4L2_MEMORY_DMABUF) {
+		b = mfc_ctxt_get_input (ctxt);
+		if (fill_first_input_buffer (ctxt, b)) {
+			stamp_input (ctxt, b, 0);
+			if (v4l2_mfc_qbuf (ctxt->handler, &b->buf) != 0) {
+				perror ("Couldn't queue the header buffer: ");
+				return false;
+			}
+			ctxt->capture_ready = true;
+		} else {
+			ctxt->in_free[ctxt->nfree++] = b->buf.index;
+		}
+	}
+
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (v4l2_mfc_streamon (ctxt->handler, type) != 0) {
+		perror ("Couldn't set stream on: ");
+		return false;;
+	}
+
+	return true;
+}
+
+/*
+ * Let the driver parse the header before asking for the CAPTURE format.
+ * Drivers that don't signal the first header are covered by G_FMT
+ * after the timeout.
+ */
+static void
+wait_source_change (struct mfc_ctxt *ctxt)
+{
+	int ret, revents;
+	struct v4l2_event ev;
+
+	if (!ctxt->events)
+		return;
+
+	do {
+		ret = v4l2_mfc_poll (ctxt->handler,
+				     POLLPRI,
+				     &revents,
+				     POLL_TIMEOUT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0 || !(revents & POLLPRI))
+		return;
+
+	while (v4l2_mfc_dqevent (ctxt->handler, &ev) == 0)
+		;
+}
+
+static bool
+mfc_ctxt_setup_output_buffers (struct mfc_ctxt *ctxt)
+{
+	int min;
+
+	if (!ctxt->startup.parsed)
+		ctxt->startup.parsed = now_ns ();
+
+	if (v4l2_mfc_g_fmt (ctxt->handler, &ctxt->fmt) != 0) {
+		perror ("Couldn't set format: ");
+		return false;
+	}
+
+	/* the decoder holds this many for reference frames */
+	if (v4l2_mfc_g_ctrl (ctxt->handler,
+			     V4L2_CID_MIN_BUFFERS_FOR_CAPTURE,
+			     &min) != 0 || min <= 0) {
+		perror ("Couldn't get the minimum number of buffers: ");
+		min = MIN_CAPTURE_BUFFERS;
+	}
+
+	if (!prepare_buffers (ctxt, OUT, min + ctxt->out_extra))
+		return false;
+
+	/* the adaptive controller starts over at every resolution */
+	ctxt->min_capture = min;
+	ctxt->adapt_max = ctxt->oc + ADAPT_MAX_GROWTH;
+	if (ctxt->adapt_max > VIDEO_MAX_FRAME)
+		ctxt->adapt_max = VIDEO_MAX_FRAME;
+	ctxt->adapt_frames = ctxt->adapt_starved = 0;
+
+	if (!create_buffers (ctxt, OUT))
+		return false;
+
+	if (!queue_buffers (ctxt, OUT))
+		return false;
+
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (v4l2_mfc_streamon (ctxt->handler, type) != 0) {
+		perror ("Couldn't set stream on: ");
+		return false;;
+	}
+
+	counter_set (&ctxt->cnt->width, ctxt->fmt.fmt.pix_mp.width);
+	counter_set (&ctxt->cnt->height, ctxt->fmt.fmt.pix_mp.height);
+	counter_set (&ctxt->cnt->capture_buffers, ctxt->oc);
+
+	if (!ctxt->startup.capture)
+		ctxt->startup.capture = now_ns ();
+	return true;
+}
+
+/*
+ * Every frame of the old resolution is back: replace the CAPTURE
+ * buffers, the OUTPUT side keeps streaming.
+ */
+static bool
+reconfigure_capture (struct mfc_ctxt *ctxt)
+{
+	uint32_t count = 0;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	if (v4l2_mfc_streamoff (ctxt->handler, type) != 0) {
+		perror ("Couldn't set stream off: ");
+		return false;
+	}
+
+	unmap_buffers (ctxt, OUT);
+	ctxt->out = NULL;
+	ctxt->oc = 0;
+
+	if (v4l2_mfc_reqbufs (ctxt->handler,
+			      type,
+			      V4L2_MEMORY_MMAP,
+			      &count) != 0) {
+		perror ("Couldn't release buffers: ");
+		return false;
+	}
+
+	ctxt->resizing = ctxt->resize_drained = false;
+	return mfc_ctxt_setup_output_buffers (ctxt);
+}
+
+/* the LAST buffer of the old resolution is out */
+static bool
+drain_resize (struct mfc_ctxt *ctxt)
+{
+	ctxt->resize_drained = true;
+
+	return ctxt->out_held > 0 || reconfigure_capture (ctxt);
+}
+
+
+/*
+ * Display delay 0 makes the MFC return each frame right after decoding
+ * it, not once it is due in display order. The controls say H264 but
+ * the driver applies them to every codec. They have to be in before
+ * the header is parsed.
+ */
+static bool
+set_low_latency (struct mfc_ctxt *ctxt)
+{
+	if (v4l2_mfc_s_ctrl (ctxt->handler,
+			     V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY_ENABLE,
+			     1) != 0 ||
+	    v4l2_mfc_s_ctrl (ctxt->handler,
+			     V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY,
+			     0) != 0) {
+		perror ("Couldn't set the display delay: ");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+mfc_ctxt_init (struct mfc_ctxt *ctxt)
+{
+	ctxt->startup.init = now_ns ();
+
+	/* lone keyframes have nothing to be reordered with either */
+	if ((ctxt->low_latency || ctxt->keyframes_only) &&
+	    !set_low_latency (ctxt))
+		return false;
+
+	if (!mfc_ctxt_setup_input_buffers (ctxt))
+		return false;
+
+	if (!ctxt->capture_ready)
+		return true;
+
+	wait_source_change (ctxt);
+	return mfc_ctxt_setup_output_buffers (ctxt);
+}
+
+bool
+mfc_ctxt_setup_capture (struct mfc_ctxt *ctxt)
+{
+	if (!mfc_ctxt_setup_output_buffers (ctxt))
+		return false;
+
+	ctxt->capture_ready = true;
+	return true;
+}
+
+struct mfc_buffer *
+mfc_ctxt_get_input (struct mfc_ctxt *ctxt)
+{
+	if (ctxt->nfree == 0)
+		return NULL;
+
+	return &ctxt->in[ctxt->in_free[--ctxt->nfree]];
+}
+
+bool
+mfc_ctxt_queue_input (struct mfc_ctxt *ctxt, struct mfc_buffer *b, int64_t pts)
+{
+	stamp_input (ctxt, b, pts);
+
+	if (v4l2_mfc_qbuf (ctxt->handler, &b->buf) != 0) {
+		counter_add (&ctxt->cnt->errors, 1);
+		perror ("Couldn't queue input buffer: ");
+		return false;
+	}
+
+	if (ctxt->capture_ready)
+		return true;
+
+	/* asynchronous callers don't wait, mfc_ctxt_dispatch () goes on */
+	if (ctxt->async_fd != -1) {
+		ctxt->header_queued = true;
+		ctxt->header_returned = false;
+		ctxt->header_deadline = now_ns () + POLL_TIMEOUT * 1000000ULL;
+		return true;
+	}
+
+	/* this was the header, the CAPTURE format is known now */
+	wait_source_change (ctxt);
+	return mfc_ctxt_setup_capture (ctxt);
+}
+
+static bool
+stop_decoder (struct mfc_ctxt *ctxt)
+{
+	if (v4l2_mfc_decoder_cmd (ctxt->handler, V4L2_DEC_CMD_STOP, false) != 0) {
+		perror ("Couldn't stop the decoder: ");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+mfc_ctxt_feed (struct mfc_ctxt *ctxt)
+{
+	struct mfc_buffer *b;
+	int64_t pts;
+
+	while (!ctxt->eos && (b = mfc_ctxt_get_input (ctxt))) {
+		/* the driver drains on command, the buffer stays ours */
+		if (!fill_input_buffer (ctxt, b, &pts) && ctxt->dec_stop) {
+			ctxt->in_free[ctxt->nfree++] = b->buf.index;
+			return stop_decoder (ctxt);
+		}
+
+		if (!mfc_ctxt_queue_input (ctxt, b, pts))
+			return false;
+	}
+
+	return true;
+}
+
+bool
+mfc_ctxt_dequeue_input (struct mfc_ctxt *ctxt)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[2];
+
+	while (v4l2_mfc_dqbuf (ctxt->handler,
+			       &buf,
+			       planes,
+			       V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			       ctxt->in_memory) == 0) {
+		assert (ctxt->nfree < ctxt->ic);
+		ctxt->in_free[ctxt->nfree++] = buf.index;
+	}
+
+	if (errno != EAGAIN) {
+		counter_add (&ctxt->cnt->errors, 1);
+		perror ("Couldn't dequeue input buffer: ");
+		return false;
+	}
+
+	return true;
+}
+
+/* keep what the driver reported about a dequeued CAPTURE buffer */
+static void
+record_dequeued (struct mfc_ctxt *ctxt, const struct v4l2_buffer *buf)
+{
+	uint32_t i;
+	struct mfc_buffer *b = &ctxt->out[buf->index];
+	struct mfc_stamp *s = get_stamp (ctxt, buf);
+
+	for (i = 0; i < b->buf.length; i++)
+		b->planes[i].bytesused = buf->m.planes[i].bytesused;
+	b->buf.flags = buf->flags;
+	b->pts = s->pts;
+	b->latency = now_ns () - s->queued;
+
+	counter_add (&ctxt->cnt->frames, 1);
+	counter_set64 (&ctxt->cnt->updated, now_ns ());
+
+	/* ours until mfc_ctxt_queue_frame () */
+	b->held = true;
+	ctxt->out_held++;
+}
+
+static void
+sample_depth (struct mfc_ctxt *ctxt)
+{
+	/* nfree belongs to the parser thread in threaded mode */
+	uint32_t nfree = __atomic_load_n (&ctxt->nfree, __ATOMIC_RELAXED);
+
+	ctxt->depth_samples++;
+	ctxt->in_depth += ctxt->ic - nfree;
+	ctxt->out_depth += ctxt->out_queued;
+
+	counter_set (&ctxt->cnt->output_queued, ctxt->ic - nfree);
+	counter_set (&ctxt->cnt->capture_queued, ctxt->out_queued);
+
+	/* every packet in the driver and frames to decode into: busy */
+	if (nfree == 0 && ctxt->out_queued > ctxt->min_capture + 1)
+		ctxt->saturated++;
+}
+
+/* add n CAPTURE buffers behind the ones there are, and queue them */
+static bool
+grow_capture (struct mfc_ctxt *ctxt, uint32_t n)
+{
+	uint32_t i, first;
+
+	if (v4l2_mfc_create_bufs (ctxt->handler,
+				  V4L2_MEMORY_MMAP,
+				  &ctxt->fmt,
+				  &n,
+				  &first) != 0 || n == 0) {
+		/* s5p-mfc has no CREATE_BUFS: keep the count we have */
+		fprintf (stderr, "CAPTURE queue can't grow, not adapting\n");
+		ctxt->adaptive = false;
+		return true;
+	}
+
+	for (i = first; i < first + n && i < VIDEO_MAX_FRAME; i++) {
+		if (!create_buffer (ctxt, OUT, i))
+			return false;
+
+		if (v4l2_mfc_qbuf (ctxt->handler, &ctxt->out[i].buf) != 0) {
+			perror ("Couldn't queue buffers: ");
+			return false;
+		}
+		ctxt->out_queued++;
+		ctxt->oc = i + 1;
+	}
+
+	counter_set (&ctxt->cnt->capture_buffers, ctxt->oc);
+	printf ("> CAPTURE queue grown to %u buffers\n", ctxt->oc);
+	return true;
+}
+
+static bool
+adapt_depth (struct mfc_ctxt *ctxt)
+{
+	uint32_t n;
+
+	/* the frame just dequeued was the last one to decode into */
+	if (ctxt->out_queued <= ctxt->min_capture)
+		ctxt->adapt_starved++;
+
+	if (++ctxt->adapt_frames < ADAPT_WINDOW)
+		return true;
+
+	n = (ctxt->adapt_starved >= ADAPT_STARVED) ? ADAPT_STEP : 0;
+	ctxt->adapt_frames = ctxt->adapt_starved = 0;
+
+	if (ctxt->oc + n > ctxt->adapt_max)
+		n = ctxt->adapt_max - ctxt->oc;
+	if (n == 0 || ctxt->resizing)
+		return true;
+
+	return grow_capture (ctxt, n);
+}
+
+static void
+count_dequeue_error (struct mfc_ctxt *ctxt)
+{
+	if (errno == EAGAIN)
+		counter_add (&ctxt->cnt->eagain, 1);
+	else if (errno == EPIPE)
+		counter_add (&ctxt->cnt->epipe, 1);
+	else
+		counter_add (&ctxt->cnt->errors, 1);
+}
+
+/*
+ * Dequeue one decoded frame. Returns 1 with its index, 0 if there is
+ * none yet or the stream is over (ctxt->done), and -1 on errors.
+ */
+int
+mfc_ctxt_dequeue_frame (struct mfc_ctxt *ctxt, uint32_t *index)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[2];
+	bool eos;
+
+again:
+	/* nothing comes until the new buffers are in */
+	if (ctxt->resize_drained)
+		return 0;
+
+	if (v4l2_mfc_dqbuf (ctxt->handler,
+			    &buf,
+			    planes,
+			    V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			    V4L2_MEMORY_MMAP) != 0) {
+		count_dequeue_error (ctxt);
+
+		/* EPIPE: the last buffer has already been dequeued */
+		if (errno == EPIPE && ctxt->resizing)
+			return drain_resize (ctxt) ? 0 : -1;
+		else if (errno == EPIPE)
+			__atomic_store_n (&ctxt->done, true, __ATOMIC_RELEASE);
+		else if (errno != EAGAIN) {
+			perror ("Couldn't dequeue output buffer: ");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!ctxt->startup.first)
+		ctxt->startup.first = now_ns ();
+
+	sample_depth (ctxt);
+	ctxt->out_queued--;
+
+	if (ctxt->adaptive && !adapt_depth (ctxt))
+		return -1;
+
+	/* the end of the old resolution, not of the stream */
+	if (ctxt->resizing && buf.flags & V4L2_BUF_FLAG_LAST) {
+		if (planes[0].bytesused == 0)
+			return drain_resize (ctxt) ? 0 : -1;
+
+		ctxt->resize_drained = true;
+		record_dequeued (ctxt, &buf);
+		*index = buf.index;
+		return 1;
+	}
+
+	eos = __atomic_load_n (&ctxt->eos, __ATOMIC_ACQUIRE);
+	if (planes[0].bytesused == 0 &&
+	    (buf.flags & V4L2_BUF_FLAG_LAST || eos)) {
+		/* not queued again until the stream restarts */
+		ctxt->last_seen = true;
+		ctxt->last_index = buf.index;
+		__atomic_store_n (&ctxt->done, true, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	/* some drivers put the last frame in the flagged buffer */
+	if (buf.flags & V4L2_BUF_FLAG_LAST) {
+		ctxt->last_seen = true;
+		__atomic_store_n (&ctxt->done, true, __ATOMIC_RELEASE);
+	}
+
+	record_dequeued (ctxt, &buf);
+
+	/* on the way from the keyframe to a seek target */
+	if (ctxt->seeking) {
+		if (ctxt->out[buf.index].pts < ctxt->seek_pts) {
+			counter_add (&ctxt->cnt->dropped, 1);
+			if (!mfc_ctxt_queue_frame (ctxt, buf.index))
+				return -1;
+			goto again;
+		}
+		ctxt->seeking = false;
+	}
+
+	*index = buf.index;
+
+	return 1;
+}
+
+bool
+mfc_ctxt_queue_frame (struct mfc_ctxt *ctxt, uint32_t index)
+{
+	ctxt->out[index].held = false;
+	ctxt->out_held--;
+
+	/* nothing else is coming */
+	if (__atomic_load_n (&ctxt->done, __ATOMIC_ACQUIRE))
+		return true;
+
+	/* the old buffers go away once the last one is back */
+	if (ctxt->resize_drained)
+		return ctxt->out_held > 0 || reconfigure_capture (ctxt);
+
+	if (v4l2_mfc_qbuf (ctxt->handler, &ctxt->out[index].buf) != 0) {
+		counter_add (&ctxt->cnt->errors, 1);
+		perror ("Couldn't queue output buffer: ");
+		return false;
+	}
+	ctxt->out_queued++;
+
+	return true;
+}
+
+void
+mfc_ctxt_get_frame (struct mfc_ctxt *ctxt,
+		    uint32_t index,
+		    struct vjmfc_frame *frame)
+{
+	uint32_t i;
+	struct mfc_buffer *b = &ctxt->out[index];
+
+	memset (frame, 0, sizeof (*frame));
+	frame->index = index;
+	frame->fourcc = ctxt->fmt.fmt.pix_mp.pixelformat;
+	frame->width = ctxt->fmt.fmt.pix_mp.width;
+	frame->height = ctxt->fmt.fmt.pix_mp.height;
+	frame->num_planes = b->buf.length;
+	frame->pts = b->pts;
+	frame->latency = b->latency;
+
+	for (i = 0; i < b->buf.length; i++) {
+		frame->plane[i] = b->paddr[i];
+		frame->dmabuf[i] = b->dmabuf[i];
+		frame->bytesused[i] = b->planes[i].bytesused;
+	}
+}
+
+void
+mfc_ctxt_emit_frame (struct mfc_ctxt *ctxt, uint32_t index)
+{
+	struct vjmfc_frame frame;
+
+	ctxt->frames++;
+
+	if (!ctxt->frame_cb)
+		return;
+
+	mfc_ctxt_get_frame (ctxt, index, &frame);
+	ctxt->frame_cb (&frame, ctxt->frame_data);
+}
+
+/*
+ * Drop everything in flight, keeping the buffers and their mappings:
+ * all OUTPUT buffers are free again and every CAPTURE buffer but the
+ * ones handed out is queued empty.
+ */
+static bool
+flush_queues (struct mfc_ctxt *ctxt)
+{
+	uint32_t i;
+	enum v4l2_buf_type in = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	enum v4l2_buf_type out = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	if (v4l2_mfc_streamoff (ctxt->handler, in) != 0) {
+		perror ("Couldn't set stream off: ");
+		return false;
+	}
+
+	ctxt->nfree = 0;
+	for (i = ctxt->ic; i > 0; i--)
+		ctxt->in_free[ctxt->nfree++] = i - 1;
+
+	if (ctxt->capture_ready) {
+		if (v4l2_mfc_streamoff (ctxt->handler, out) != 0) {
+			perror ("Couldn't set stream off: ");
+			return false;
+		}
+
+		/* held frames come back through mfc_ctxt_queue_frame () */
+		ctxt->out_queued = 0;
+		for (i = 0; i < ctxt->oc; i++) {
+			if (ctxt->out[i].held)
+				continue;
+			if (v4l2_mfc_qbuf (ctxt->handler, &ctxt->out[i].buf) != 0) {
+				perror ("Couldn't queue output buffer: ");
+				return false;
+			}
+			ctxt->out_queued++;
+		}
+
+		if (v4l2_mfc_streamon (ctxt->handler, out) != 0) {
+			perror ("Couldn't set stream on: ");
+			return false;
+		}
+	}
+
+	if (v4l2_mfc_streamon (ctxt->handler, in) != 0) {
+		perror ("Couldn't set stream on: ");
+		return false;
+	}
+
+	/* the LAST buffer was queued again with the others */
+	ctxt->last_seen = false;
+	ctxt->last_index = -1;
+
+	ctxt->resizing = ctxt->resize_drained = false;
+	__atomic_store_n (&ctxt->eos, false, __ATOMIC_RELEASE);
+	__atomic_store_n (&ctxt->done, false, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Once OUTPUT was stopped the header goes first again, or streams with
+ * their parameter sets only in the extradata can't be decoded.
+ */
+static bool
+requeue_header (struct mfc_ctxt *ctxt)
+{
+	struct mfc_buffer *b;
+
+	if (ctxt->header_size == 0 || ctxt->in_memory == V4L2_MEMORY_DMABUF ||
+	    !(b = mfc_ctxt_get_input (ctxt)))
+		return true;
+
+	if (!fill_first_input_buffer (ctxt, b)) {
+		ctxt->in_free[ctxt->nfree++] = b->buf.index;
+		return true;
+	}
+
+	return mfc_ctxt_queue_input (ctxt, b, 0);
+}
+
+/*
+ * Restart decoding from the keyframe before pts, in the units of the
+ * frame timestamps. Only the queues are restarted, the device context
+ * and every mapping stay.
+ */
+bool
+mfc_ctxt_seek (struct mfc_ctxt *ctxt, int64_t pts)
+{
+	if (!mfc_ctxt_has_file (ctxt))
+		return false;
+
+	if (!flush_queues (ctxt))
+		return false;
+
+	if (ctxt->es.data) {
+		es_seek (&ctxt->es, pts > 0 ? pts : 0);
+	} else {
+		if (ctxt->pkt_pending) {
+			av_packet_unref (&ctxt->pkt);
+			ctxt->pkt_pending = false;
+		}
+
+		/* the read-ahead is from before the seek, drop it */
+		prefetch_stop (&ctxt->prefetch);
+
+		if (av_seek_video (ctxt->fc, pts) < 0) {
+			fprintf (stderr, "Couldn't seek to %lld\n", (long long) pts);
+			return false;
+		}
+
+		if (ctxt->prefetch.slots && !prefetch_start (&ctxt->prefetch))
+			return false;
+	}
+
+	ctxt->seek_pts = pts;
+	ctxt->seeking = true;
+	ctxt->next_key = 0;
+
+	return requeue_header (ctxt);
+}
+
+/* flag resolution changes; they are acted upon at the LAST buffer */
+bool
+mfc_ctxt_handle_events (struct mfc_ctxt *ctxt)
+{
+	struct v4l2_event ev;
+
+	while (v4l2_mfc_dqevent (ctxt->handler, &ev) == 0) {
+		if (ev.type == V4L2_EVENT_SOURCE_CHANGE &&
+		    ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION &&
+		    ctxt->capture_ready) {
+			ctxt->resizing = true;
+			counter_add (&ctxt->cnt->resolution_changes, 1);
+		}
+	}
+
+	if (errno != ENOENT) {
+		perror ("Couldn't dequeue event: ");
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+dequeue_output (struct mfc_ctxt *ctxt)
+{
+	int ret;
+	uint32_t idx;
+
+	while ((ret = mfc_ctxt_dequeue_frame (ctxt, &idx)) > 0) {
+		mfc_ctxt_emit_frame (ctxt, idx);
+
+		if (!mfc_ctxt_queue_frame (ctxt, idx))
+			return false;
+	}
+
+	return ret == 0;
+}
+
+bool
+mfc_ctxt_service (struct mfc_ctxt *ctxt, int revents)
+{
+	if (revents & POLLERR) {
+		fprintf (stderr, "Device reported an error\n");
+		return false;
+	}
+
+	if (revents & POLLPRI && !mfc_ctxt_handle_events (ctxt))
+		return false;
+
+	/* drain decoded frames first, so the CAPTURE queue never runs dry */
+	if (revents & POLLIN && !dequeue_output (ctxt))
+		return false;
+
+	if (revents & POLLOUT && !mfc_ctxt_dequeue_input (ctxt))
+		return false;
+
+	return true;
+}
+
+bool
+mfc_ctxt_decode (struct mfc_ctxt *ctxt)
+{
+	int ret, revents;
+
+	while (!ctxt->done) {
+		if (!mfc_ctxt_feed (ctxt))
+			return false;
+
+		ret = v4l2_mfc_poll (ctxt->handler,
+				     POLLIN | POLLOUT | POLLPRI,
+				     &revents,
+				     POLL_TIMEOUT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("Couldn't poll the device: ");
+			return false;
+		}
+
+		if (ret == 0) {
+			/* some drivers never flag the last buffer */
+			if (ctxt->eos)
+				break;
+			fprintf (stderr, "Timeout waiting for the device\n");
+			return false;
+		}
+
+		if (!mfc_ctxt_service (ctxt, revents))
+			return false;
+	}
+
+	return true;
+}
+
+/* no more input: what the driver has is decoded, then LAST comes */
+static bool
+end_stream (struct mfc_ctxt *ctxt)
+{
+	int ret, revents;
+	struct mfc_buffer *b;
+
+	__atomic_store_n (&ctxt->eos, true, __ATOMIC_RELEASE);
+
+	if (ctxt->dec_stop)
+		return stop_decoder (ctxt);
+
+	/* the empty buffer needs a free one */
+	while (!(b = mfc_ctxt_get_input (ctxt))) {
+		ret = v4l2_mfc_poll (ctxt->handler,
+				     POLLOUT,
+				     &revents,
+				     POLL_TIMEOUT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0 || !mfc_ctxt_dequeue_input (ctxt)) {
+			fprintf (stderr, "No input buffer to end the stream\n");
+			return false;
+		}
+	}
+
+	b->planes[0].bytesused = 0;
+	return mfc_ctxt_queue_input (ctxt, b, 0);
+}
+
+/*
+ * End the stream where it is and decode what's in flight; the frames
+ * still go to frame_cb. Buffers and mappings stay, for a restart.
+ */
+static bool
+drain_stream (struct mfc_ctxt *ctxt)
+{
+	if (ctxt->done || !ctxt->capture_ready)
+		return true;
+
+	if (!ctxt->eos && !end_stream (ctxt))
+		return false;
+
+	return mfc_ctxt_decode (ctxt);
+}
+
+/*
+ * Tear down before closing: both queues stop where they are, nothing
+ * is drained and no frame goes to frame_cb any more.
+ */
+bool
+mfc_ctxt_deinit (struct mfc_ctxt *ctxt)
+{
+	bool ok = true;
+	enum v4l2_buf_type in = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	enum v4l2_buf_type out = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	ctxt->frame_cb = NULL;
+
+	if (ctxt->handler == -1)
+		return true;
+
+	if (ctxt->capture_ready && v4l2_mfc_streamoff (ctxt->handler, out) != 0) {
+		perror ("Couldn't set stream off: ");
+		ok = false;
+	}
+
+	if (ctxt->in_ready && v4l2_mfc_streamoff (ctxt->handler, in) != 0) {
+		perror ("Couldn't set stream off: ");
+		ok = false;
+	}
+
+	return ok;
+}
+
+/* after LAST: decode again, with every buffer there was */
+static bool
+resume (struct mfc_ctxt *ctxt)
+{
+	/* without LAST there's no telling what is queued: start over */
+	if (!ctxt->dec_start || !ctxt->last_seen)
+		return flush_queues (ctxt);
+
+	if (v4l2_mfc_decoder_cmd (ctxt->handler, V4L2_DEC_CMD_START, false) != 0) {
+		perror ("Couldn't start the decoder: ");
+		return false;
+	}
+
+	if (ctxt->last_index >= 0) {
+		if (v4l2_mfc_qbuf (ctxt->handler,
+				   &ctxt->out[ctxt->last_index].buf) != 0) {
+			perror ("Couldn't queue output buffer: ");
+			return false;
+		}
+		ctxt->out_queued++;
+	}
+
+	__atomic_store_n (&ctxt->eos, false, __ATOMIC_RELEASE);
+	__atomic_store_n (&ctxt->done, false, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Go on with the next file of a playlist or the next segment: same
+ * codec, same device and buffers, no remapping. The current stream is
+ * drained to its end first.
+ */
+bool
+mfc_ctxt_restart (struct mfc_ctxt *ctxt, const char *filename)
+{
+	if (!ctxt->capture_ready || !drain_stream (ctxt))
+		return false;
+
+	close_source (ctxt);
+	if (!open_source (ctxt, filename))
+		return false;
+
+	if (!resume (ctxt))
+		return false;
+
+	ctxt->last_seen = false;
+	ctxt->last_index = -1;
+	ctxt->seeking = false;
+	ctxt->next_key = 0;
+
+	/* the new header goes first; a new size comes as a source change */
+	return requeue_header (ctxt);
+}
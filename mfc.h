@@ -0,0 +1,272 @@
+#ifndef MFC_CTXT_H_
+#define MFC_CTXT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "v4l2_mfc.h"
+#include "av.h"
+#include "ring.h"
+#include "arena.h"
+#include "es.h"
+#include "prefetch.h"
+#include "packetizer.h"
+#include "counters.h"
+#include "vjmfc.h"
+
+#define MFC_DEC_DRIVER "s5p-mfc-dec"
+
+enum dir { IN, OUT };
+
+struct mfc_buffer {
+	void *paddr[2];
+	int dmabuf[2];
+	struct v4l2_plane planes[2];
+	struct v4l2_buffer buf;
+
+	/* CAPTURE only: where the frame came from, and who has it */
+	int64_t pts;
+	uint64_t latency;
+	bool held;
+};
+
+/*
+ * OUTPUT buffers carry a sequence number as their timestamp, which the
+ * driver copies to the CAPTURE buffer decoded from them. It indexes
+ * this table to get back the real pts and when the packet was queued.
+ * It has to be larger than the number of packets in flight, counting
+ * the ones held as reference frames.
+ */
+#define MFC_STAMPS 256
+
+struct mfc_stamp {
+	int64_t pts;
+	uint64_t queued;	/* ns, CLOCK_MONOTONIC */
+};
+
+/*
+ * Room for the largest queues the driver may give us on both sides,
+ * so buffer descriptors never come from the heap after mfc_ctxt_new ().
+ */
+#define MFC_ARENA_SIZE \
+	(2 * VIDEO_MAX_FRAME * (sizeof (struct mfc_buffer) + 16) + \
+	 VIDEO_MAX_FRAME * sizeof (uint32_t) + 16)
+
+/* when each step of getting to the first frame ended, ns */
+struct mfc_startup {
+	uint64_t start, probed, info, init, parsed, capture, first;
+	uint64_t device, buffers;	/* durations, from the helper thread */
+};
+
+struct mfc_ctxt {
+	int handler;
+	int node;		/* which of the decoder's nodes, see dev.h */
+	uint64_t opened;	/* ns, when the handle was taken */
+
+	/* the file: a raw elementary stream, or demuxed (fc) */
+	struct es es;
+	AVFormatContext *fc;
+
+	struct mfc_buffer *in, *out;
+	uint32_t ic, oc;
+
+	/* descriptors: OUTPUT side first, CAPTURE from out_mark on */
+	struct arena arena;
+	size_t out_mark;
+
+	/* reused for every demuxed packet */
+	AVPacket pkt;
+
+	/* demuxing ahead of the OUTPUT queue, when read_ahead is set */
+	uint32_t read_ahead;
+	size_t read_ahead_bytes;
+	struct prefetch prefetch;
+
+	/* compressed format and the stream header queued first */
+	uint32_t codec;
+	const uint8_t *header;
+	uint32_t header_size;
+
+	/*
+	 * V4L2_DEC_CMD_STOP/START. LAST was dequeued, empty in last_index
+	 * (-1 if it carried a frame), which waits for the restart.
+	 */
+	bool dec_stop, dec_start;
+	bool last_seen;
+	int last_index;
+
+	/* OUTPUT buffers allocated, maybe while the demuxer was probing */
+	bool in_ready, startup_ok;
+	struct mfc_startup startup;
+
+	/* how packets go into OUTPUT buffers, see mfc_ctxt_set_codec () */
+	struct packetizer pz;
+
+	/* requested OUTPUT count and CAPTURE depth beyond the minimum */
+	uint32_t in_count, out_extra;
+
+	/*
+	 * Pack as many frames as fit in each OUTPUT buffer; the driver
+	 * runs a buffer again until it is consumed (not for H.264).
+	 */
+	bool batch;
+	bool pkt_pending;	/* pkt was read but didn't fit */
+
+	/* hand out frames in decode order, as soon as they are ready */
+	bool low_latency;
+
+	/*
+	 * Only queue keyframes, at most one per key_interval seconds
+	 * (raw streams have no clock and get every keyframe).
+	 */
+	bool keyframes_only;
+	double key_interval, next_key;
+
+	/* export CAPTURE planes as dmabufs instead of mapping them */
+	bool export_dmabuf;
+
+	/*
+	 * How OUTPUT buffers are backed: driver memory (MMAP), a
+	 * page-aligned pool owned by the context (USERPTR), one slot of
+	 * in_size bytes per buffer, or caller dmabufs (DMABUF).
+	 */
+	enum v4l2_memory in_memory;
+	uint32_t in_size;
+	uint8_t *in_pool;
+	struct v4l2_format fmt;
+
+	/* the CAPTURE queue is set up once the header is queued */
+	bool capture_ready;
+
+	/*
+	 * Subscribed to V4L2_EVENT_SOURCE_CHANGE. On a resolution change
+	 * the old frames are drained up to the LAST buffer, then the
+	 * CAPTURE buffers are replaced once every held one is back.
+	 */
+	bool events;
+	bool resizing, resize_drained;
+
+	vjmfc_frame_cb frame_cb;
+	void *frame_data;
+
+	/* indices of the OUTPUT buffers owned by userspace */
+	uint32_t *in_free;
+	uint32_t nfree;
+
+	uint32_t frames;
+	bool eos, done;
+
+	struct mfc_stamp stamps[MFC_STAMPS];
+	uint32_t seq;
+
+	/* CAPTURE buffers owned by the driver, and handed out as frames */
+	uint32_t out_queued, out_held;
+
+	/* after a seek, frames before seek_pts are decoded but not shown */
+	bool seeking;
+	int64_t seek_pts;
+
+	/* queue occupancy, sampled at every decoded frame */
+	uint64_t depth_samples, in_depth, out_depth;
+
+	/*
+	 * Samples where the hardware had every packet and room to decode:
+	 * reading faster would gain nothing.
+	 */
+	uint64_t saturated;
+
+	/* grow CAPTURE while the consumer keeps the driver short of it */
+	bool adaptive;
+	uint32_t min_capture, adapt_max;
+	uint32_t adapt_frames, adapt_starved;
+
+	/* threaded mode: CAPTURE indices between display and consumer */
+	struct ring filled, released;
+	int filled_efd, released_efd;
+	bool failed;
+
+	/*
+	 * Asynchronous mode: an epoll set (async_fd) of the eventfd and,
+	 * while it holds buffers, the device. The header is queued
+	 * without waiting for the driver to parse it.
+	 */
+	int async_fd, kick_efd;
+	bool watching, header_queued, drained;
+	/* drivers without events: an OUTPUT buffer came back, and until when */
+	bool header_returned;
+	uint64_t header_deadline;
+	struct vjmfc_callbacks callbacks;
+
+	/* live counters: an exported slot (see counters.h), or own */
+	struct vjmfc_counters own, *cnt;
+};
+
+static inline bool
+mfc_ctxt_has_file (const struct mfc_ctxt *ctxt)
+{
+	return ctxt->es.data || ctxt->fc;
+}
+
+/* how long to wait for the hardware before giving up (ms) */
+#define POLL_TIMEOUT 1000
+
+static inline uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct mfc_ctxt *mfc_ctxt_new (void);
+bool mfc_ctxt_set_preset (struct mfc_ctxt *ctxt, enum vjmfc_preset preset);
+bool mfc_ctxt_set_codec (struct mfc_ctxt *ctxt,
+			 uint32_t codec,
+			 const uint8_t *header,
+			 uint32_t size);
+bool mfc_ctxt_open (struct mfc_ctxt *ctxt, const char *filename);
+bool mfc_ctxt_open_device (struct mfc_ctxt *ctxt);
+void mfc_ctxt_close (struct mfc_ctxt *ctxt);
+void mfc_ctxt_free (struct mfc_ctxt *ctxt);
+
+bool mfc_ctxt_init (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_setup_capture (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_deinit (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_restart (struct mfc_ctxt *ctxt, const char *filename);
+
+struct mfc_buffer *mfc_ctxt_get_input (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_queue_input (struct mfc_ctxt *ctxt,
+			   struct mfc_buffer *b,
+			   int64_t pts);
+bool mfc_ctxt_feed (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_dequeue_input (struct mfc_ctxt *ctxt);
+
+int mfc_ctxt_dequeue_frame (struct mfc_ctxt *ctxt, uint32_t *index);
+bool mfc_ctxt_queue_frame (struct mfc_ctxt *ctxt, uint32_t index);
+void mfc_ctxt_get_frame (struct mfc_ctxt *ctxt,
+			 uint32_t index,
+			 struct vjmfc_frame *frame);
+void mfc_ctxt_emit_frame (struct mfc_ctxt *ctxt, uint32_t index);
+
+bool mfc_ctxt_seek (struct mfc_ctxt *ctxt, int64_t pts);
+
+bool mfc_ctxt_handle_events (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_service (struct mfc_ctxt *ctxt, int revents);
+bool mfc_ctxt_decode (struct mfc_ctxt *ctxt);
+
+/* thread.c */
+bool mfc_ctxt_decode_threaded (struct mfc_ctxt *ctxt);
+
+/* multi.c */
+bool mfc_ctxt_decode_many (struct mfc_ctxt **ctxts, unsigned int n);
+
+/* async.c */
+bool mfc_ctxt_async_init (struct mfc_ctxt *ctxt,
+			  const struct vjmfc_callbacks *callbacks);
+void mfc_ctxt_kick (struct mfc_ctxt *ctxt);
+bool mfc_ctxt_dispatch (struct mfc_ctxt *ctxt);
+void mfc_ctxt_async_close (struct mfc_ctxt *ctxt);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "mfc.h"
+
+/*
+ * Many contexts, each with its own fd and buffers, serviced from one
+ * epoll loop. The MFC keeps a hardware context per open fd, so streams
+ * only share the device, never the queues.
+ */
+
+#define MAX_EVENTS 16
+
+static bool
+remove_ctxt (int efd, struct mfc_ctxt *ctxt)
+{
+	if (epoll_ctl (efd, EPOLL_CTL_DEL, ctxt->handler, NULL) != 0) {
+		perror ("Couldn't remove context from epoll: ");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+mfc_ctxt_decode_many (struct mfc_ctxt **ctxts, unsigned int n)
+{
+	int efd, nev, i;
+	unsigned int j, active = 0;
+	bool ok = true;
+	struct mfc_ctxt *ctxt;
+	struct epoll_event ev, events[MAX_EVENTS];
+
+	efd = epoll_create1 (EPOLL_CLOEXEC);
+	if (efd < 0) {
+		perror ("Couldn't create epoll: ");
+		return false;
+	}
+
+	for (j = 0; j < n; j++) {
+		ctxt = ctxts[j];
+
+		/* never in the set: the timeout must not count it again */
+		if (!mfc_ctxt_feed (ctxt)) {
+			ctxt->failed = ctxt->done = true;
+			ok = false;
+			continue;
+		}
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLPRI;
+		ev.data.ptr = ctxt;
+		if (epoll_ctl (efd, EPOLL_CTL_ADD, ctxt->handler, &ev) != 0) {
+			perror ("Couldn't add context to epoll: ");
+			ctxt->failed = ctxt->done = true;
+			ok = false;
+			continue;
+		}
+
+		active++;
+	}
+
+	while (active > 0) {
+		nev = epoll_wait (efd, events, MAX_EVENTS, POLL_TIMEOUT);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("Couldn't wait for the devices: ");
+			ok = false;
+			break;
+		}
+
+		/*
+		 * Nobody moved for a whole timeout: streams past their end
+		 * are finished (their driver never flagged the last buffer),
+		 * the others are stuck.
+		 */
+		if (nev == 0) {
+			for (j = 0; j < n; j++) {
+				ctxt = ctxts[j];
+				if (ctxt->done || ctxt->failed)
+					continue;
+				if (!ctxt->eos) {
+					fprintf (stderr, "Timeout waiting for stream %u\n", j);
+					ctxt->failed = true;
+					ok = false;
+				}
+				ctxt->done = true;
+				remove_ctxt (efd, ctxt);
+				active--;
+			}
+			continue;
+		}
+
+		for (i = 0; i < nev; i++) {
+			ctxt = events[i].data.ptr;
+
+			/* EPOLL* and POLL* bits are the same */
+			if (!mfc_ctxt_service (ctxt, events[i].events) ||
+			    !mfc_ctxt_feed (ctxt)) {
+				ctxt->failed = true;
+				ok = false;
+			}
+
+			if (ctxt->done || ctxt->failed) {
+				ctxt->done = true;
+				remove_ctxt (efd, ctxt);
+				active--;
+			}
+		}
+	}
+
+	close (efd);
+	return ok;
+}
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "packetizer.h"
+
+#define NAL_SPS 7
+
+static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+
+static size_t
+copy_write (const struct packetizer *p,
+	    uint8_t *dst,
+	    size_t room,
+	    const uint8_t *au,
+	    size_t size,
+	    bool key)
+{
+	if (size > room)
+		return 0;
+
+	memcpy (dst, au, size);
+	return size;
+}
+
+static const struct packetizer_ops copy_ops = {
+	.name = "copy",
+	.write = copy_write,
+};
+
+static inline size_t
+nal_size (const uint8_t *p, uint32_t length)
+{
+	size_t n = 0;
+	uint32_t i;
+
+	for (i = 0; i < length; i++)
+		n = (n << 8) | p[i];
+
+	return n;
+}
+
+/*
+ * Every length prefix becomes a start code, and keyframes that don't
+ * carry their own SPS get the header first, so decoding can start (or
+ * restart, after a seek) at any of them.
+ */
+static size_t
+avcc_write (const struct packetizer *p,
+	    uint8_t *dst,
+	    size_t room,
+	    const uint8_t *au,
+	    size_t size,
+	    bool key)
+{
+	size_t pos, n, end, out = 0;
+	uint32_t len = p->nal_length;
+	bool sps = false;
+
+	/* sizes first, stopping at anything that runs past the packet */
+	for (pos = 0; pos + len < size; pos += len + n) {
+		n = nal_size (au + pos, len);
+		if (n == 0 || n > size - pos - len)
+			break;
+		if ((au[pos + len] & 0x1f) == NAL_SPS)
+			sps = true;
+		out += sizeof (start_code) + n;
+	}
+	end = pos;
+
+	if (key && !sps)
+		out += p->header_size;
+	if (out == 0 || out > room)
+		return 0;
+
+	out = 0;
+	if (key && !sps) {
+		memcpy (dst, p->header, p->header_size);
+		out = p->header_size;
+	}
+
+	for (pos = 0; pos < end; pos += len + n) {
+		n = nal_size (au + pos, len);
+		memcpy (dst + out, start_code, sizeof (start_code));
+		memcpy (dst + out + sizeof (start_code), au + pos + len, n);
+		out += sizeof (start_code) + n;
+	}
+
+	return out;
+}
+
+static const struct packetizer_ops avcc_ops = {
+	.name = "avcc",
+	.converts = true,
+	.write = avcc_write,
+};
+
+/* the parameter sets of an avcC record, each behind a start code */
+static bool
+avcc_header (struct packetizer *p, const uint8_t *config, size_t size)
+{
+	size_t pos = 6, n, out = 0;
+	uint32_t sets, i, list;
+	uint8_t *header;
+
+	p->nal_length = (config[4] & 3) + 1;
+
+	/* sized up front: every set grows by two bytes at most */
+	header = malloc (size * 2);
+	if (!header)
+		return false;
+
+	/* the SPS count is in config[5], the PPS one after the SPSs */
+	sets = config[5] & 0x1f;
+	for (list = 0; list < 2; list++) {
+		for (i = 0; i < sets; i++) {
+			if (pos + 2 > size)
+				goto bad;
+			n = (config[pos] << 8) | config[pos + 1];
+			pos += 2;
+			if (n > size - pos)
+				goto bad;
+
+			memcpy (header + out, start_code, sizeof (start_code));
+			memcpy (header + out + sizeof (start_code),
+				config + pos, n);
+			out += sizeof (start_code) + n;
+			pos += n;
+		}
+
+		if (list == 0) {
+			if (pos >= size)
+				break;
+			sets = config[pos++];
+		}
+	}
+
+	p->header = header;
+	p->header_size = out;
+	return true;
+
+bad:
+	free (header);
+	return false;
+}
+
+static bool
+h264_init (struct packetizer *p, const uint8_t *config, size_t size)
+{
+	/* Annex-B configuration (TS, raw streams) goes as it is */
+	if (size < 7 || config[0] != 1)
+		return true;
+
+	if (!avcc_header (p, config, size))
+		return false;
+
+	p->ops = &avcc_ops;
+	return true;
+}
+
+static const struct {
+	uint32_t codec;
+	bool (*init) (struct packetizer *p, const uint8_t *config, size_t size);
+} packetizers[] = {
+	{ V4L2_PIX_FMT_H264, h264_init },
+};
+
+bool
+packetizer_init (struct packetizer *p,
+		 uint32_t codec,
+		 const uint8_t *config,
+		 size_t size)
+{
+	size_t i;
+
+	packetizer_free (p);
+	p->ops = &copy_ops;
+
+	for (i = 0; i < sizeof (packetizers) / sizeof (packetizers[0]); i++) {
+		if (packetizers[i].codec == codec)
+			return packetizers[i].init (p, config, size);
+	}
+
+	return true;
+}
+
+void
+packetizer_free (struct packetizer *p)
+{
+	free (p->header);
+	memset (p, 0, sizeof (*p));
+}
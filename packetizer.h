@@ -0,0 +1,60 @@
+#ifndef PACKETIZER_H_
+#define PACKETIZER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Writes access units into OUTPUT buffers the way the MFC takes them,
+ * converting on the way when the container stores them otherwise. The
+ * ops are picked once per stream from the codec and its configuration;
+ * most formats are copied as they are, while H.264 from MP4/MKV (avcC
+ * configuration, length-prefixed NAL units) is rewritten to Annex-B.
+ */
+struct packetizer;
+
+struct packetizer_ops {
+	const char *name;
+	bool converts;		/* the input can't be queued as it is */
+	/*
+	 * Write au to dst and return how many bytes that took, or 0 when
+	 * it doesn't fit in room. Keyframes may get the header in front.
+	 */
+	size_t (*write) (const struct packetizer *p,
+			 uint8_t *dst,
+			 size_t room,
+			 const uint8_t *au,
+			 size_t size,
+			 bool key);
+};
+
+struct packetizer {
+	const struct packetizer_ops *ops;
+
+	/* the header to queue first, when the configuration is converted */
+	uint8_t *header;
+	uint32_t header_size;
+
+	uint32_t nal_length;	/* bytes of each NAL unit's length field */
+};
+
+/* any codec goes, the unknown ones are copied */
+bool packetizer_init (struct packetizer *p,
+		      uint32_t codec,
+		      const uint8_t *config,
+		      size_t size);
+void packetizer_free (struct packetizer *p);
+
+static inline size_t
+packetizer_write (const struct packetizer *p,
+		  uint8_t *dst,
+		  size_t room,
+		  const uint8_t *au,
+		  size_t size,
+		  bool key)
+{
+	return p->ops->write (p, dst, room, au, size, key);
+}
+
+#endif
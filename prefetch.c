@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "prefetch.h"
+
+/* how far ahead of the demuxer the page cache is filled */
+#define ADVISE_WINDOW (8 << 20)
+
+bool
+prefetch_open (struct prefetch *p,
+	       AVFormatContext *fc,
+	       const char *filename,
+	       uint32_t packets,
+	       size_t bytes)
+{
+	uint32_t i;
+	struct stat st;
+
+	memset (p, 0, sizeof (*p));
+	p->fd = -1;
+	p->fc = fc;
+	p->size = packets;
+	p->max_bytes = bytes;
+
+	p->slots = calloc (packets, sizeof (AVPacket));
+	if (!p->slots)
+		return false;
+	for (i = 0; i < packets; i++)
+		av_init_packet (&p->slots[i]);
+
+	pthread_mutex_init (&p->lock, NULL);
+	pthread_cond_init (&p->cond, NULL);
+
+	/* URLs and pipes get no hints */
+	if (stat (filename, &st) == 0 && S_ISREG (st.st_mode)) {
+		p->fd = open (filename, O_RDONLY | O_CLOEXEC);
+		if (p->fd != -1)
+			posix_fadvise (p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	return true;
+}
+
+static void
+drop_packets (struct prefetch *p)
+{
+	for (; p->tail != p->head; p->tail++)
+		av_packet_unref (&p->slots[p->tail % p->size]);
+	p->head = p->tail = 0;
+	p->bytes = 0;
+}
+
+/* keep the next window of the file on its way into the page cache */
+static void
+advise (struct prefetch *p)
+{
+	int64_t pos;
+
+	if (p->fd == -1 || !p->fc->pb)
+		return;
+
+	pos = avio_tell (p->fc->pb);
+	if (pos < 0)
+		return;
+
+	if (p->advised < pos)
+		p->advised = pos;
+	if (p->advised - pos > ADVISE_WINDOW / 2)
+		return;
+
+	posix_fadvise (p->fd, p->advised, ADVISE_WINDOW, POSIX_FADV_WILLNEED);
+	p->advised += ADVISE_WINDOW;
+}
+
+static bool
+is_full (struct prefetch *p)
+{
+	/* a packet bigger than the budget still gets in alone */
+	return p->head - p->tail == p->size ||
+		(p->head != p->tail && p->bytes >= p->max_bytes);
+}
+
+static void *
+prefetch_thread (void *data)
+{
+	int ret;
+	AVPacket pkt;
+	struct prefetch *p = data;
+
+	av_init_packet (&pkt);
+
+	for (;;) {
+		pthread_mutex_lock (&p->lock);
+		while (!p->stop && is_full (p))
+			pthread_cond_wait (&p->cond, &p->lock);
+		if (p->stop) {
+			pthread_mutex_unlock (&p->lock);
+			break;
+		}
+		pthread_mutex_unlock (&p->lock);
+
+		/* the read itself is the slow part, done unlocked */
+		advise (p);
+		ret = av_read_video_packet (p->fc, &pkt);
+
+		pthread_mutex_lock (&p->lock);
+		if (ret < 0) {
+			p->err = ret;
+			p->eof = true;
+		} else {
+			av_packet_move_ref (&p->slots[p->head % p->size], &pkt);
+			p->bytes += p->slots[p->head % p->size].size;
+			p->head++;
+		}
+		pthread_cond_broadcast (&p->cond);
+		pthread_mutex_unlock (&p->lock);
+
+		if (ret < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+bool
+prefetch_start (struct prefetch *p)
+{
+	if (p->running)
+		return true;
+
+	p->stop = p->eof = false;
+	p->err = 0;
+	p->advised = 0;
+
+	if (pthread_create (&p->thread, NULL, prefetch_thread, p) != 0) {
+		perror ("Couldn't start the read-ahead thread: ");
+		return false;
+	}
+
+	p->running = true;
+	return true;
+}
+
+void
+prefetch_stop (struct prefetch *p)
+{
+	if (p->running) {
+		pthread_mutex_lock (&p->lock);
+		p->stop = true;
+		pthread_cond_broadcast (&p->cond);
+		pthread_mutex_unlock (&p->lock);
+
+		pthread_join (p->thread, NULL);
+		p->running = false;
+	}
+
+	drop_packets (p);
+}
+
+int
+prefetch_read (struct prefetch *p, AVPacket *pkt)
+{
+	int ret = 0;
+
+	pthread_mutex_lock (&p->lock);
+
+	if (p->head == p->tail && !p->eof)
+		p->stalls++;
+	while (p->head == p->tail && !p->eof)
+		pthread_cond_wait (&p->cond, &p->lock);
+
+	if (p->head != p->tail) {
+		av_packet_move_ref (pkt, &p->slots[p->tail % p->size]);
+		p->bytes -= pkt->size;
+		p->tail++;
+		pthread_cond_broadcast (&p->cond);
+	} else {
+		ret = p->err;
+	}
+
+	pthread_mutex_unlock (&p->lock);
+	return ret;
+}
+
+void
+prefetch_close (struct prefetch *p)
+{
+	if (!p->slots)
+		return;
+
+	prefetch_stop (p);
+	free (p->slots);
+	p->slots = NULL;
+
+	pthread_mutex_destroy (&p->lock);
+	pthread_cond_destroy (&p->cond);
+
+	if (p->fd != -1)
+		close (p->fd);
+	p->fd = -1;
+}
@@ -0,0 +1,53 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "av.h"
+
+/*
+ * Read-ahead for demuxed files: a thread of its own reads video packets
+ * into a ring of preallocated slots, bounded both in packets and in
+ * bytes, so a slow read doesn't hold up the OUTPUT queue. For local
+ * files the kernel is also asked to read the next window in advance.
+ *
+ * While started the thread owns the format context; stop it before
+ * seeking or reading from it directly.
+ */
+struct prefetch {
+	AVFormatContext *fc;
+	AVPacket *slots;
+	uint32_t size, head, tail;
+	size_t bytes, max_bytes;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running, stop, eof;
+	int err;		/* why the thread stopped reading */
+
+	/* the same file, for the page cache hints; -1 if not local */
+	int fd;
+	int64_t advised;
+
+	uint64_t stalls;	/* reads that found the ring empty */
+};
+
+bool prefetch_open (struct prefetch *p,
+		    AVFormatContext *fc,
+		    const char *filename,
+		    uint32_t packets,
+		    size_t bytes);
+void prefetch_close (struct prefetch *p);
+
+bool prefetch_start (struct prefetch *p);
+/* joins the thread and drops whatever was read ahead */
+void prefetch_stop (struct prefetch *p);
+
+/* like av_read_video_packet (), blocking while the ring is empty */
+int prefetch_read (struct prefetch *p, AVPacket *pkt);
+
+#endif
@@ -0,0 +1,60 @@
+#include <stdlib.h>
+
+#include "ring.h"
+
+bool
+ring_init (struct ring *r, uint32_t size)
+{
+	uint32_t n = 1;
+
+	/* round up to a power of two so the index wraps with a mask */
+	while (n < size)
+		n <<= 1;
+
+	r->slots = calloc (n, sizeof (uint32_t));
+	if (!r->slots)
+		return false;
+
+	r->mask = n - 1;
+	r->head = 0;
+	r->tail = 0;
+
+	return true;
+}
+
+void
+ring_destroy (struct ring *r)
+{
+	free (r->slots);
+	r->slots = NULL;
+}
+
+bool
+ring_push (struct ring *r, uint32_t v)
+{
+	uint32_t head = r->head;
+	uint32_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail > r->mask)
+		return false;
+
+	r->slots[head & r->mask] = v;
+	__atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+bool
+ring_pop (struct ring *r, uint32_t *v)
+{
+	uint32_t tail = r->tail;
+	uint32_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return false;
+
+	*v = r->slots[tail & r->mask];
+	__atomic_store_n (&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
@@ -0,0 +1,27 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RING_CACHELINE 64
+
+/*
+ * Single-producer/single-consumer queue of buffer indices. Only the
+ * producer moves the head and only the consumer moves the tail, so
+ * no lock is needed as long as there is exactly one of each.
+ */
+struct ring {
+	uint32_t *slots;
+	uint32_t mask;
+	uint32_t head __attribute__ ((aligned (RING_CACHELINE)));
+	uint32_t tail __attribute__ ((aligned (RING_CACHELINE)));
+};
+
+bool ring_init (struct ring *r, uint32_t size);
+void ring_destroy (struct ring *r);
+
+bool ring_push (struct ring *r, uint32_t v);
+bool ring_pop (struct ring *r, uint32_t *v);
+
+#endif
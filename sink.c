@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * The CRC instructions are compiled in for their function only and
+ * picked at run time, so the default build gets them on the CPUs that
+ * have them.
+ */
+#if defined (__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C 1
+#define CRC32C_TARGET __attribute__ ((target ("sse4.2")))
+#define crc32c_u64(c, v) _mm_crc32_u64 (c, v)
+#define crc32c_u8(c, v) _mm_crc32_u8 (c, v)
+#elif defined (__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define HAVE_CRC32C 1
+#define CRC32C_TARGET __attribute__ ((target ("+crc")))
+#define crc32c_u64(c, v) __crc32cd (c, v)
+#define crc32c_u8(c, v) __crc32cb (c, v)
+#endif
+
+#include "sink.h"
+
+#define DIRECT_ALIGN 4096
+#define BOUNCE_SIZE (4 << 20)
+
+/* ms between looks at a pipe that isn't full but not drained either */
+#define DRAIN_MAX_DELAY 8
+
+/* CRC-32C (Castagnoli), reflected */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_update) (uint32_t crc, const uint8_t *p, size_t n);
+
+/* slicing by 8, little endian */
+static uint32_t
+crc_sliced (uint32_t crc, const uint8_t *p, size_t n)
+{
+	uint32_t a, b;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy (&a, p, 4);
+		memcpy (&b, p + 4, 4);
+		a ^= crc;
+		crc = crc_table[7][a & 0xff] ^
+			crc_table[6][(a >> 8) & 0xff] ^
+			crc_table[5][(a >> 16) & 0xff] ^
+			crc_table[4][a >> 24] ^
+			crc_table[3][b & 0xff] ^
+			crc_table[2][(b >> 8) & 0xff] ^
+			crc_table[1][(b >> 16) & 0xff] ^
+			crc_table[0][b >> 24];
+	}
+
+	for (; n > 0; n--, p++)
+		crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if HAVE_CRC32C
+CRC32C_TARGET static uint32_t
+crc_hw (uint32_t crc, const uint8_t *p, size_t n)
+{
+	uint64_t v;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy (&v, p, 8);
+		crc = crc32c_u64 (crc, v);
+	}
+
+	for (; n > 0; n--, p++)
+		crc = crc32c_u8 (crc, *p);
+
+	return crc;
+}
+
+static bool
+crc_hw_supported (void)
+{
+#if defined (__x86_64__)
+	return __builtin_cpu_supports ("sse4.2");
+#else
+	return getauxval (AT_HWCAP) & HWCAP_CRC32;
+#endif
+}
+#endif
+
+static void
+crc_init (void)
+{
+	uint32_t i, k, c;
+
+#if HAVE_CRC32C
+	if (crc_hw_supported ()) {
+		crc_update = crc_hw;
+		return;
+	}
+#endif
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++) {
+			c = crc_table[k - 1][i];
+			crc_table[k][i] = (c >> 8) ^ crc_table[0][c & 0xff];
+		}
+	}
+
+	crc_update = crc_sliced;
+}
+
+static uint32_t
+crc32c (uint32_t crc, const uint8_t *p, size_t n)
+{
+	pthread_once (&crc_once, crc_init);
+	return ~crc_update (~crc, p, n);
+}
+
+bool
+write_all (int fd, const void *data, size_t size)
+{
+	ssize_t ret;
+	const uint8_t *p = data;
+
+	while (size > 0) {
+		ret = write (fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static bool
+open_frames (struct sink *s, const char *path)
+{
+	struct stat st;
+
+	if (strcmp (path, "-") == 0) {
+		/* keep stdout for the frames, the logs go to stderr */
+		s->fd = dup (STDOUT_FILENO);
+		if (s->fd < 0 || dup2 (STDERR_FILENO, STDOUT_FILENO) < 0)
+			return false;
+		s->own_fd = true;
+	} else {
+		s->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		/* tmpfs and friends have no O_DIRECT */
+		if (s->fd < 0 && errno == EINVAL)
+			s->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (s->fd < 0)
+			return false;
+		s->own_fd = true;
+	}
+
+	if (fstat (s->fd, &st) != 0)
+		return false;
+
+	if (S_ISFIFO (st.st_mode)) {
+		s->mode = SINK_SPLICE;
+	} else if (fcntl (s->fd, F_GETFL) & O_DIRECT) {
+		s->mode = SINK_DIRECT;
+		if (posix_memalign ((void **) &s->bounce,
+				    DIRECT_ALIGN,
+				    BOUNCE_SIZE) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool
+sink_open (struct sink *s, const char *frames, const char *sums)
+{
+	memset (s, 0, sizeof (*s));
+	s->fd = -1;
+	s->mode = SINK_WRITE;
+
+	if (frames && !open_frames (s, frames)) {
+		perror ("Couldn't open the frame output: ");
+		sink_close (s);
+		return false;
+	}
+
+	if (sums) {
+		s->sums = (strcmp (sums, "-") == 0) ? stdout : fopen (sums, "w");
+		if (!s->sums) {
+			perror ("Couldn't open the checksum output: ");
+			sink_close (s);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+flush_direct (struct sink *s)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < s->fill) {
+		ret = pwrite (s->fd, s->bounce + done, s->fill - done,
+			      s->offset + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		done += ret;
+	}
+
+	s->offset += s->fill;
+	s->fill = 0;
+	return true;
+}
+
+/* frames are rarely block sized: go through the aligned bounce buffer */
+static bool
+write_direct (struct sink *s, const uint8_t *p, size_t n)
+{
+	size_t len;
+
+	while (n > 0) {
+		len = BOUNCE_SIZE - s->fill;
+		if (len > n)
+			len = n;
+
+		memcpy (s->bounce + s->fill, p, len);
+		s->fill += len;
+		p += len;
+		n -= len;
+
+		if (s->fill == BOUNCE_SIZE && !flush_direct (s))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+write_splice (struct sink *s, const uint8_t *p, size_t n)
+{
+	ssize_t ret;
+	struct iovec iov = {
+		.iov_base = (void *) p,
+		.iov_len = n,
+	};
+
+	while (iov.iov_len > 0) {
+		ret = vmsplice (s->fd, &iov, 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* device mappings can't be spliced, copy from now on */
+			if (errno == EFAULT || errno == EINVAL) {
+				s->mode = SINK_WRITE;
+				return write_all (s->fd, iov.iov_base, iov.iov_len);
+			}
+			return false;
+		}
+		iov.iov_base = (uint8_t *) iov.iov_base + ret;
+		iov.iov_len -= ret;
+	}
+
+	return true;
+}
+
+/*
+ * The pipe holds references to the frame's pages, and the driver will
+ * decode into them again once the frame is released: wait for the
+ * reader first.
+ */
+static void
+wait_drained (int fd)
+{
+	int n, delay = 1;
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLOUT,
+	};
+
+	while (ioctl (fd, FIONREAD, &n) == 0 && n > 0) {
+		/* asleep for as long as the pipe is full */
+		if (poll (&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		/* the reader is gone, nobody will look at the pages */
+		if (pfd.revents & (POLLERR | POLLHUP))
+			return;
+
+		/* no event tells it's empty: back off until it is */
+		if (ioctl (fd, FIONREAD, &n) != 0 || n == 0)
+			return;
+		poll (NULL, 0, delay);
+		if (delay < DRAIN_MAX_DELAY)
+			delay *= 2;
+	}
+}
+
+static bool
+write_plane (struct sink *s, const uint8_t *p, size_t n)
+{
+	switch (s->mode) {
+	case SINK_SPLICE:
+		return write_splice (s, p, n);
+	case SINK_DIRECT:
+		return write_direct (s, p, n);
+	default:
+		return write_all (s->fd, p, n);
+	}
+}
+
+void
+sink_frame (const struct vjmfc_frame *frame, void *data)
+{
+	uint32_t i, crc = 0;
+	bool ok = true;
+	struct sink *s = data;
+
+	s->frames++;
+
+	/* exported frames have no mapping to read */
+	for (i = 0; i < frame->num_planes; i++) {
+		if (!frame->plane[i]) {
+			s->failed++;
+			return;
+		}
+	}
+
+	for (i = 0; s->fd >= 0 && ok && i < frame->num_planes; i++) {
+		ok = write_plane (s, frame->plane[i], frame->bytesused[i]);
+		s->bytes += frame->bytesused[i];
+	}
+
+	if (s->mode == SINK_SPLICE)
+		wait_drained (s->fd);
+
+	if (!ok) {
+		perror ("Couldn't write frame: ");
+		s->failed++;
+	}
+
+	if (s->sums) {
+		for (i = 0; i < frame->num_planes; i++)
+			crc = crc32c (crc, frame->plane[i], frame->bytesused[i]);
+		fprintf (s->sums, "%lld %08x\n", (long long) frame->pts, crc);
+	}
+}
+
+bool
+sink_close (struct sink *s)
+{
+	bool ok = s->failed == 0;
+	uint64_t size;
+	size_t pad;
+
+	/* the tail goes out padded, then the padding is cut off */
+	if (s->mode == SINK_DIRECT && s->fill > 0) {
+		size = s->offset + s->fill;
+		pad = (s->fill + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+		memset (s->bounce + s->fill, 0, pad - s->fill);
+		s->fill = pad;
+		ok = flush_direct (s) && ftruncate (s->fd, size) == 0 && ok;
+	}
+
+	if (s->own_fd)
+		close (s->fd);
+	s->fd = -1;
+	free (s->bounce);
+	s->bounce = NULL;
+
+	if (s->sums && s->sums != stdout)
+		ok = fclose (s->sums) == 0 && ok;
+	s->sums = NULL;
+
+	return ok;
+}
@@ -0,0 +1,46 @@
+#ifndef SINK_H_
+#define SINK_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vjmfc.h"
+
+/*
+ * Writes the raw planes of every frame, back to back, and/or a line of
+ * "pts crc32c" per frame. Pipes get the planes by vmsplice (), regular
+ * files through O_DIRECT so a long run doesn't fill the page cache.
+ */
+enum sink_mode {
+	SINK_WRITE,
+	SINK_SPLICE,
+	SINK_DIRECT,
+};
+
+struct sink {
+	int fd;			/* -1 without frame output */
+	enum sink_mode mode;
+	bool own_fd;
+
+	/* O_DIRECT wants aligned memory, offsets and sizes */
+	uint8_t *bounce;
+	size_t fill;
+	uint64_t offset;
+
+	FILE *sums;
+	uint32_t frames, failed;
+	uint64_t bytes;
+};
+
+/* write () until everything is out */
+bool write_all (int fd, const void *data, size_t size);
+
+/*
+ * Either path may be NULL. "-" writes to stdout; for frames, stdout
+ * itself is pointed at stderr so nothing else gets mixed in.
+ */
+bool sink_open (struct sink *s, const char *frames, const char *sums);
+void sink_frame (const struct vjmfc_frame *frame, void *data);
+bool sink_close (struct sink *s);
+
+#endif
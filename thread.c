@@ -0,0 +1,264 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "mfc.h"
+
+/*
+ * Threaded mode, as in the usage summary in mfc.c: the parser thread
+ * owns the OUTPUT queue and the display thread owns the CAPTURE queue.
+ * Decoded frames are handed to the consumer (the calling thread)
+ * through the filled ring and come back through the released ring, so
+ * neither side ever takes a lock. The eventfds are only doorbells for
+ * sleeping when a ring is empty.
+ */
+
+static void
+ring_signal (int efd)
+{
+	uint64_t one = 1;
+
+	if (write (efd, &one, sizeof (one)) != sizeof (one))
+		perror ("Couldn't signal ring: ");
+}
+
+static void
+ring_wait (int efd, int timeout)
+{
+	uint64_t cnt;
+	struct pollfd pfd = {
+		.fd = efd,
+		.events = POLLIN,
+	};
+
+	if (poll (&pfd, 1, timeout) > 0)
+		(void) !read (efd, &cnt, sizeof (cnt));
+}
+
+static void
+mfc_ctxt_fail (struct mfc_ctxt *ctxt)
+{
+	__atomic_store_n (&ctxt->failed, true, __ATOMIC_RELEASE);
+	__atomic_store_n (&ctxt->done, true, __ATOMIC_RELEASE);
+	ring_signal (ctxt->filled_efd);
+	ring_signal (ctxt->released_efd);
+}
+
+static void *
+parser_thread (void *data)
+{
+	int ret, revents;
+	struct mfc_ctxt *ctxt = data;
+
+	while (!__atomic_load_n (&ctxt->done, __ATOMIC_ACQUIRE)) {
+		if (!mfc_ctxt_feed (ctxt))
+			goto fail;
+
+		if (ctxt->eos)
+			break;
+
+		/* every buffer is queued now, wait for one to come back */
+		ret = v4l2_mfc_poll (ctxt->handler,
+				     POLLOUT,
+				     &revents,
+				     POLL_TIMEOUT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("Couldn't poll the device: ");
+			goto fail;
+		}
+
+		if (ret == 0) {
+			fprintf (stderr, "Timeout waiting for input buffers\n");
+			goto fail;
+		}
+
+		if (revents & POLLERR) {
+			fprintf (stderr, "Device reported an error\n");
+			goto fail;
+		}
+
+		if (!mfc_ctxt_dequeue_input (ctxt))
+			goto fail;
+	}
+
+	__atomic_store_n (&ctxt->eos, true, __ATOMIC_RELEASE);
+	return NULL;
+
+fail:
+	__atomic_store_n (&ctxt->eos, true, __ATOMIC_RELEASE);
+	mfc_ctxt_fail (ctxt);
+	return NULL;
+}
+
+static bool
+requeue_released (struct mfc_ctxt *ctxt)
+{
+	uint32_t idx;
+
+	while (ring_pop (&ctxt->released, &idx)) {
+		if (!mfc_ctxt_queue_frame (ctxt, idx))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+dequeue_filled (struct mfc_ctxt *ctxt)
+{
+	int ret;
+	uint32_t idx;
+
+	while ((ret = mfc_ctxt_dequeue_frame (ctxt, &idx)) > 0) {
+		/* never fails: the ring fits the largest CAPTURE queue */
+		ring_push (&ctxt->filled, idx);
+		ring_signal (ctxt->filled_efd);
+	}
+
+	return ret == 0;
+}
+
+static void *
+display_thread (void *data)
+{
+	int ret;
+	uint64_t cnt;
+	struct mfc_ctxt *ctxt = data;
+	struct pollfd pfd[2] = {
+		{ .fd = ctxt->handler, .events = POLLIN | POLLPRI },
+		{ .fd = ctxt->released_efd, .events = POLLIN },
+	};
+
+	while (!__atomic_load_n (&ctxt->done, __ATOMIC_ACQUIRE)) {
+		if (!requeue_released (ctxt))
+			goto fail;
+
+		/*
+		 * The consumer holds everything, or the frames it holds are
+		 * all that stands before a resolution change: wait until it
+		 * gives them back.
+		 */
+		if (ctxt->out_queued == 0 || ctxt->resize_drained) {
+			ring_wait (ctxt->released_efd, POLL_TIMEOUT);
+			continue;
+		}
+
+		ret = poll (pfd, 2, POLL_TIMEOUT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("Couldn't poll the device: ");
+			goto fail;
+		}
+
+		if (ret == 0) {
+			if (__atomic_load_n (&ctxt->eos, __ATOMIC_ACQUIRE))
+				break;
+			fprintf (stderr, "Timeout waiting for the device\n");
+			goto fail;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			(void) !read (ctxt->released_efd, &cnt, sizeof (cnt));
+
+		if (pfd[0].revents & POLLERR) {
+			fprintf (stderr, "Device reported an error\n");
+			goto fail;
+		}
+
+		if (pfd[0].revents & POLLPRI && !mfc_ctxt_handle_events (ctxt))
+			goto fail;
+
+		if (pfd[0].revents & POLLIN && !dequeue_filled (ctxt))
+			goto fail;
+	}
+
+	__atomic_store_n (&ctxt->done, true, __ATOMIC_RELEASE);
+	ring_signal (ctxt->filled_efd);
+	return NULL;
+
+fail:
+	mfc_ctxt_fail (ctxt);
+	return NULL;
+}
+
+bool
+mfc_ctxt_decode_threaded (struct mfc_ctxt *ctxt)
+{
+	pthread_t parser, display;
+	uint32_t idx;
+	bool done;
+
+	/* the CAPTURE queue must not be set up behind the display thread */
+	if (!ctxt->capture_ready) {
+		fprintf (stderr, "Stream has no header\n");
+		return false;
+	}
+
+	/*
+	 * Set up once and kept across restarts; a resolution change may
+	 * bring more CAPTURE buffers.
+	 */
+	if ((!ctxt->filled.slots &&
+	     !ring_init (&ctxt->filled, VIDEO_MAX_FRAME)) ||
+	    (!ctxt->released.slots &&
+	     !ring_init (&ctxt->released, VIDEO_MAX_FRAME))) {
+		perror ("Couldn't allocate rings: ");
+		return false;
+	}
+
+	if (ctxt->filled_efd == -1)
+		ctxt->filled_efd = eventfd (0, EFD_NONBLOCK);
+	if (ctxt->released_efd == -1)
+		ctxt->released_efd = eventfd (0, EFD_NONBLOCK);
+	if (ctxt->filled_efd < 0 || ctxt->released_efd < 0) {
+		perror ("Couldn't create eventfd: ");
+		return false;
+	}
+
+	if (pthread_create (&parser, NULL, parser_thread, ctxt) != 0) {
+		perror ("Couldn't create parser thread: ");
+		return false;
+	}
+
+	if (pthread_create (&display, NULL, display_thread, ctxt) != 0) {
+		perror ("Couldn't create display thread: ");
+		mfc_ctxt_fail (ctxt);
+		pthread_join (parser, NULL);
+		return false;
+	}
+
+	do {
+		/* read done first: the display thread pushes before setting it */
+		done = __atomic_load_n (&ctxt->done, __ATOMIC_ACQUIRE);
+
+		while (ring_pop (&ctxt->filled, &idx)) {
+			mfc_ctxt_emit_frame (ctxt, idx);
+			ring_push (&ctxt->released, idx);
+			ring_signal (ctxt->released_efd);
+		}
+
+		if (!done)
+			ring_wait (ctxt->filled_efd, POLL_TIMEOUT);
+	} while (!done);
+
+	pthread_join (parser, NULL);
+	pthread_join (display, NULL);
+
+	/*
+	 * A frame may have come with the last buffer flag. It goes back
+	 * through the released ring, for the next run after a restart.
+	 */
+	while (ring_pop (&ctxt->filled, &idx)) {
+		mfc_ctxt_emit_frame (ctxt, idx);
+		ring_push (&ctxt->released, idx);
+	}
+
+	return !ctxt->failed;
+}
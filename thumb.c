@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include "thumb.h"
+#include "sink.h"
+
+void
+thumb_start (struct thumb *t, const char *dir)
+{
+	memset (t, 0, sizeof (*t));
+	t->dir = dir;
+}
+
+void
+thumb_free (struct thumb *t)
+{
+	free (t->image);
+	t->image = NULL;
+}
+
+/* into t->image, packed with no padding */
+static bool
+convert (struct thumb *t, const struct vjmfc_frame *frame, uint32_t *size)
+{
+	uint8_t *p;
+	uint32_t w = frame->width, h = frame->height;
+	struct vjmfc_image image = {
+		.format = t->format,
+	};
+
+	*size = (t->format == VJMFC_PIXFMT_RGB24) ? w * h * 3 :
+		w * h + 2 * ((w + 1) / 2) * ((h + 1) / 2);
+
+	if (*size > t->size) {
+		p = realloc (t->image, *size);
+		if (!p)
+			return false;
+		t->image = p;
+		t->size = *size;
+	}
+
+	image.plane[0] = t->image;
+	image.stride[0] = (t->format == VJMFC_PIXFMT_RGB24) ? w * 3 : w;
+	image.plane[1] = t->image + (size_t) w * h;
+	image.stride[1] = (t->format == VJMFC_PIXFMT_I420) ? (w + 1) / 2 : w;
+	image.plane[2] = image.plane[1] + (size_t) image.stride[1] * ((h + 1) / 2);
+	image.stride[2] = image.stride[1];
+
+	return vjmfc_convert_frame (frame, &image, 0) == 0;
+}
+
+static const char *
+extension (const struct thumb *t, const struct vjmfc_frame *frame)
+{
+	if (!t->convert)
+		return frame->fourcc == V4L2_PIX_FMT_NV12MT ? "nv12mt" : "nv12";
+
+	switch (t->format) {
+	case VJMFC_PIXFMT_I420:
+		return "i420";
+	case VJMFC_PIXFMT_RGB24:
+		return "rgb";
+	default:
+		return "nv12";
+	}
+}
+
+void
+thumb_frame (const struct vjmfc_frame *frame, void *data)
+{
+	int fd;
+	uint32_t i, size = 0;
+	char path[4096];
+	bool ok = true;
+	struct thumb *t = data;
+	const char *ext = extension (t, frame);
+
+	if (t->convert && !convert (t, frame, &size)) {
+		fprintf (stderr, "Couldn't convert frame\n");
+		t->failed++;
+		return;
+	}
+
+	snprintf (path, sizeof (path), "%s/thumb-%06lld.%s", t->dir,
+		  (long long) frame->pts, ext);
+
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror ("Couldn't create thumbnail: ");
+		t->failed++;
+		return;
+	}
+
+	/* unconverted planes go from the mapping to the page cache */
+	if (t->convert)
+		ok = write_all (fd, t->image, size);
+	for (i = 0; !t->convert && i < frame->num_planes && ok; i++)
+		ok = write_all (fd, frame->plane[i], frame->bytesused[i]);
+
+	if (!ok) {
+		perror ("Couldn't write thumbnail: ");
+		t->failed++;
+	} else {
+		t->frames++;
+	}
+
+	close (fd);
+}
@@ -0,0 +1,26 @@
+#ifndef THUMB_H_
+#define THUMB_H_
+
+#include <stdint.h>
+
+#include "vjmfc.h"
+
+/*
+ * Writes every frame it gets as dir/thumb-<pts>.<ext>: the planes one
+ * after the other straight from the CAPTURE mapping, or converted first
+ * when convert is set.
+ */
+struct thumb {
+	const char *dir;
+	bool convert;
+	enum vjmfc_pixfmt format;
+	uint8_t *image;
+	size_t size;
+	uint32_t frames, failed;
+};
+
+void thumb_start (struct thumb *t, const char *dir);
+void thumb_frame (const struct vjmfc_frame *frame, void *data);
+void thumb_free (struct thumb *t);
+
+#endif
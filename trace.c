@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "trace.h"
+
+#ifdef VJMFC_TRACE
+
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <linux/videodev2.h>
+
+#define TRACE_EVENTS 4096
+
+struct trace_event {
+	const char *name;
+	uint64_t start, dur;	/* ns */
+	long tid;		/* rings outlive their threads */
+	int err;
+	int index, type;
+};
+
+struct trace_buf {
+	struct trace_buf *next;
+	long tid;
+	bool busy;		/* a live thread records into it */
+	uint32_t head;
+	uint64_t eagain;
+	struct trace_event ev[TRACE_EVENTS];
+};
+
+/*
+ * Every ring ever created, pushed with a CAS and never removed. A ring
+ * is handed to the next new thread once its own exits, so short-lived
+ * threads don't add up.
+ */
+static struct trace_buf *bufs;
+static __thread struct trace_buf *self;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static void
+release_buf (void *data)
+{
+	struct trace_buf *b = data;
+
+	__atomic_store_n (&b->busy, false, __ATOMIC_RELEASE);
+}
+
+static void
+init_exit_key (void)
+{
+	(void) pthread_key_create (&exit_key, release_buf);
+}
+
+/* a ring whose thread is gone */
+static struct trace_buf *
+reuse_buf (void)
+{
+	bool busy;
+	struct trace_buf *b;
+
+	for (b = __atomic_load_n (&bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+		busy = false;
+		if (__atomic_compare_exchange_n (&b->busy, &busy, true, false,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			return b;
+	}
+
+	return NULL;
+}
+
+uint64_t
+trace_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_buf *
+get_buf (void)
+{
+	struct trace_buf *b;
+
+	pthread_once (&exit_once, init_exit_key);
+
+	b = reuse_buf ();
+	if (b) {
+		b->tid = syscall (SYS_gettid);
+		pthread_setspecific (exit_key, b);
+		return b;
+	}
+
+	b = calloc (1, sizeof (struct trace_buf));
+	if (!b)
+		return NULL;
+
+	b->tid = syscall (SYS_gettid);
+	b->busy = true;
+	pthread_setspecific (exit_key, b);
+	b->next = __atomic_load_n (&bufs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n (&bufs, &b->next, b, true,
+					     __ATOMIC_RELEASE,
+					     __ATOMIC_RELAXED))
+		;
+
+	return b;
+}
+
+void
+trace_record (const char *name, uint64_t start, int ret, int index, int type)
+{
+	int err = errno;
+	uint32_t head;
+	struct trace_event *ev;
+
+	if (!self && !(self = get_buf ())) {
+		errno = err;
+		return;
+	}
+
+	head = self->head;
+	ev = &self->ev[head % TRACE_EVENTS];
+	ev->name = name;
+	ev->start = start;
+	ev->dur = trace_now () - start;
+	ev->tid = self->tid;
+	ev->err = (ret < 0) ? err : 0;
+	ev->index = index;
+	ev->type = type;
+
+	if (ret < 0 && err == EAGAIN)
+		self->eagain++;
+
+	__atomic_store_n (&self->head, head + 1, __ATOMIC_RELEASE);
+
+	/* the caller looks at errno after us */
+	errno = err;
+}
+
+static const char *
+queue_name (int type)
+{
+	switch (type) {
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+		return "OUTPUT";
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+		return "CAPTURE";
+	default:
+		return "";
+	}
+}
+
+/* meant for when decoding is over: a busy ring may tear its oldest span */
+int
+trace_dump (const char *filename)
+{
+	uint32_t i, head, first;
+	bool comma = false;
+	struct trace_buf *b;
+	struct trace_event *ev;
+	FILE *f = fopen (filename, "w");
+
+	if (!f)
+		return -errno;
+
+	fprintf (f, "{\"traceEvents\": [");
+
+	for (b = __atomic_load_n (&bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+		head = __atomic_load_n (&b->head, __ATOMIC_ACQUIRE);
+		first = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+
+		for (i = first; i < head; i++) {
+			ev = &b->ev[i % TRACE_EVENTS];
+			fprintf (f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", "
+				 "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, "
+				 "\"tid\": %ld, \"args\": {\"index\": %d, "
+				 "\"queue\": \"%s\", \"errno\": %d}}",
+				 comma ? "," : "", ev->name, ev->start / 1e3,
+				 ev->dur / 1e3, (int) getpid (), ev->tid,
+				 ev->index, queue_name (ev->type), ev->err);
+			comma = true;
+		}
+
+		/* EAGAIN count per ring, on its latest thread's track */
+		fprintf (f, "%s\n{\"name\": \"EAGAIN\", \"ph\": \"C\", "
+			 "\"ts\": %.3f, \"pid\": %d, \"tid\": %ld, "
+			 "\"args\": {\"count\": %llu}}",
+			 comma ? "," : "", trace_now () / 1e3, (int) getpid (),
+			 b->tid, (unsigned long long) b->eagain);
+		comma = true;
+	}
+
+	fprintf (f, "\n]}\n");
+
+	if (fclose (f) != 0)
+		return -errno;
+
+	return 0;
+}
+
+#else
+
+int
+trace_dump (const char *filename)
+{
+	return -ENOSYS;
+}
+
+#endif
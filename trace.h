@@ -0,0 +1,38 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * ioctl tracing, only built with VJMFC_TRACE (make TRACE=1); without it
+ * the macros vanish and nothing is left on the hot path.
+ *
+ * Every thread records spans into its own ring, so recording takes no
+ * lock. Old spans are overwritten once a ring is full, and the ring of
+ * a thread that exited goes to the next new one.
+ */
+
+#ifdef VJMFC_TRACE
+
+uint64_t trace_now (void);
+void trace_record (const char *name,
+		   uint64_t start,
+		   int ret,
+		   int index,
+		   int type);
+
+#define TRACE_BEGIN(t) uint64_t t = trace_now ()
+#define TRACE_END(t, name, ret, index, type) \
+	trace_record (name, t, ret, index, type)
+
+#else
+
+#define TRACE_BEGIN(t)
+#define TRACE_END(t, name, ret, index, type)
+
+#endif
+
+/* Chrome trace / Perfetto JSON of every ring; -ENOSYS without tracing */
+int trace_dump (const char *filename);
+
+#endif
@@ -3,16 +3,41 @@
 #include <string.h>
 #include <stdio.h>
 #include <poll.h>
+#include <fcntl.h>
 
 #include <sys/ioctl.h>
 
+#include "trace.h"
+
+/* every ioctl goes through here, so tracing sees all of them */
+static inline int
+mfc_ioctl (int fd,
+	   unsigned long req,
+	   const char *name,
+	   void *arg,
+	   const struct v4l2_buffer *buf)
+{
+	int ret;
+
+	TRACE_BEGIN (t);
+	ret = ioctl (fd, req, arg);
+	TRACE_END (t, name, ret,
+		   (buf && ret == 0) ? (int) buf->index : -1,
+		   buf ? (int) buf->type : 0);
+
+	return ret;
+}
+
+#define IOCTL(fd, req, arg) mfc_ioctl (fd, req, #req, arg, NULL)
+#define IOCTL_BUF(fd, req, buf) mfc_ioctl (fd, req, #req, buf, buf)
+
 int
 v4l2_mfc_querycap (int fd)
 {
 	int ret;
 	struct v4l2_capability cap;
 
-	ret = ioctl (fd, VIDIOC_QUERYCAP, &cap);
+	ret = IOCTL (fd, VIDIOC_QUERYCAP, &cap);
 	if (ret != 0) {
 		perror ("VIDIOC_QUERYCAP failed: ");
 		return ret;
@@ -55,7 +80,17 @@ v4l2_mfc_s_fmt (int fd,
 		},
 	};
 
-	ret = ioctl (fd, VIDIOC_S_FMT, &fmt);
+	ret = IOCTL (fd, VIDIOC_S_FMT, &fmt);
+	return ret;
+}
+
+int
+v4l2_mfc_s_fmt_mp (int fd,
+		   struct v4l2_format *fmt)
+{
+	int ret;
+
+	ret = IOCTL (fd, VIDIOC_S_FMT, fmt);
 	return ret;
 }
 
@@ -72,12 +107,33 @@ v4l2_mfc_reqbufs (int fd,
 		.count = *buf_cnt,
 	};
 
-	ret = ioctl (fd, VIDIOC_REQBUFS, &reqbuf);
+	ret = IOCTL (fd, VIDIOC_REQBUFS, &reqbuf);
 	*buf_cnt = reqbuf.count;
 
 	return ret;
 }
 
+int
+v4l2_mfc_create_bufs (int fd,
+		      enum v4l2_memory memory,
+		      const struct v4l2_format *fmt,
+		      uint32_t *count,
+		      uint32_t *index)
+{
+	int ret;
+	struct v4l2_create_buffers create = {
+		.count = *count,
+		.memory = memory,
+		.format = *fmt,
+	};
+
+	ret = IOCTL (fd, VIDIOC_CREATE_BUFS, &create);
+	*count = create.count;
+	*index = create.index;
+
+	return ret;
+}
+
 int
 v4l2_mfc_querybuf (int fd,
 		   int index,
@@ -95,7 +151,7 @@ v4l2_mfc_querybuf (int fd,
 		.m.planes = planes,
 	};
 
-	ret = ioctl (fd, VIDIOC_QUERYBUF, &b);
+	ret = IOCTL_BUF (fd, VIDIOC_QUERYBUF, &b);
 
 	if (buf)
 		memcpy(buf, &b, sizeof (struct v4l2_buffer));
@@ -109,7 +165,7 @@ v4l2_mfc_streamon (int fd,
 {
     int ret;
 
-    ret = ioctl (fd, VIDIOC_STREAMON, &type);
+    ret = IOCTL (fd, VIDIOC_STREAMON, &type);
     return ret;
 }
 
@@ -119,7 +175,7 @@ v4l2_mfc_streamoff (int fd,
 {
     int ret;
 
-    ret = ioctl (fd, VIDIOC_STREAMOFF, &type);
+    ret = IOCTL (fd, VIDIOC_STREAMOFF, &type);
     return ret;
 }
 
@@ -134,7 +190,7 @@ v4l2_mfc_s_ctrl (int fd,
 	    .value = value,
     };
 
-    ret = ioctl (fd, VIDIOC_S_CTRL, &ctrl);
+    ret = IOCTL (fd, VIDIOC_S_CTRL, &ctrl);
     return ret;
 }
 
@@ -148,7 +204,7 @@ v4l2_mfc_g_ctrl (int fd,
 	    .id = id,
     };
 
-    ret = ioctl (fd, VIDIOC_G_CTRL, &ctrl);
+    ret = IOCTL (fd, VIDIOC_G_CTRL, &ctrl);
     *value = ctrl.value;
 
     return ret;
@@ -160,30 +216,52 @@ v4l2_mfc_qbuf (int fd,
 {
 	int ret;
 
-	ret = ioctl (fd, VIDIOC_QBUF, buf);
+	ret = IOCTL_BUF (fd, VIDIOC_QBUF, buf);
 	return ret;
 }
 
 int
 v4l2_mfc_dqbuf (int fd,
 		struct v4l2_buffer *dqbuf,
+		struct v4l2_plane *planes,
 		enum v4l2_buf_type type,
 		enum v4l2_memory memory)
 {
-	struct v4l2_plane planes[2];
-	int ret, length = 0;
-
-	if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
-		length = 1;
-	else if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
-		length = 2;
+	int ret;
 
+	/*
+	 * Room for the two planes of raw frames on either queue: the
+	 * encoder takes them on OUTPUT. The driver fills as many as the
+	 * format has.
+	 */
 	dqbuf->type = type;
 	dqbuf->memory = memory;
 	dqbuf->m.planes = planes;
-	dqbuf->length = length;
+	dqbuf->length = 2;
+
+	ret = IOCTL_BUF (fd, VIDIOC_DQBUF, dqbuf);
+	return ret;
+}
+
+int
+v4l2_mfc_expbuf (int fd,
+		 enum v4l2_buf_type type,
+		 int index,
+		 int plane,
+		 int *dmafd)
+{
+	int ret;
+	struct v4l2_exportbuffer expbuf = {
+		.type = type,
+		.index = index,
+		.plane = plane,
+		.flags = O_CLOEXEC | O_RDWR,
+	};
+
+	ret = IOCTL (fd, VIDIOC_EXPBUF, &expbuf);
+	if (ret == 0)
+		*dmafd = expbuf.fd;
 
-	ret = ioctl (fd, VIDIOC_DQBUF, dqbuf);
 	return ret;
 }
 
@@ -197,7 +275,7 @@ v4l2_mfc_g_fmt (int fd,
 	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
     };
 
-    ret = ioctl (fd, VIDIOC_G_FMT, &f);
+    ret = IOCTL (fd, VIDIOC_G_FMT, &f);
 
     if (fmt)
 	    memcpy (fmt, &f, sizeof (struct v4l2_format));
@@ -213,23 +291,75 @@ v4l2_mfc_g_crop (int fd,
     int ret;
 
     crop->type = type;
-    ret = ioctl (fd, VIDIOC_G_CROP, crop);
+    ret = IOCTL (fd, VIDIOC_G_CROP, crop);
     return ret;
 }
 
+int
+v4l2_mfc_encoder_cmd (int fd, uint32_t cmd)
+{
+	int ret;
+	struct v4l2_encoder_cmd ec = {
+		.cmd = cmd,
+	};
+
+	ret = IOCTL (fd, VIDIOC_ENCODER_CMD, &ec);
+	return ret;
+}
+
+int
+v4l2_mfc_decoder_cmd (int fd, uint32_t cmd, bool try)
+{
+	int ret;
+	struct v4l2_decoder_cmd dc = {
+		.cmd = cmd,
+	};
+
+	if (try)
+		ret = IOCTL (fd, VIDIOC_TRY_DECODER_CMD, &dc);
+	else
+		ret = IOCTL (fd, VIDIOC_DECODER_CMD, &dc);
+	return ret;
+}
+
+int
+v4l2_mfc_subscribe_event (int fd, uint32_t type)
+{
+	int ret;
+	struct v4l2_event_subscription sub = {
+		.type = type,
+	};
+
+	ret = IOCTL (fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+	return ret;
+}
+
+int
+v4l2_mfc_dqevent (int fd, struct v4l2_event *ev)
+{
+	int ret;
+
+	memset (ev, 0, sizeof (*ev));
+	ret = IOCTL (fd, VIDIOC_DQEVENT, ev);
+	return ret;
+}
+
 int
 v4l2_mfc_poll (int fd,
+	       short events,
 	       int *revents,
 	       int timeout)
 {
     int ret;
     struct pollfd poll_events = {
 	    .fd = fd,
-	    .events = POLLOUT | POLLERR,
+	    .events = events | POLLERR,
 	    .revents = 0,
     };
 
+    TRACE_BEGIN (t);
     ret = poll ((struct pollfd*) &poll_events, 1, timeout);
+    TRACE_END (t, "poll", ret, -1, 0);
     *revents = poll_events.revents;
 
     return ret;
@@ -2,6 +2,7 @@
 #define MFC_H_
 
 #include <linux/videodev2.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 int v4l2_mfc_querycap (int fd);
@@ -10,11 +11,22 @@ int v4l2_mfc_s_fmt (int fd,
 		    uint32_t pfmt,
 		    unsigned int size);
 
+/* any format on either queue, updated with what the driver took */
+int v4l2_mfc_s_fmt_mp (int fd,
+		       struct v4l2_format *fmt);
+
 int v4l2_mfc_reqbufs (int fd,
 		      enum v4l2_buf_type type,
 		      enum v4l2_memory memory,
 		      uint32_t *buf_cnt);
 
+/* count more buffers in fmt, numbered from *index on */
+int v4l2_mfc_create_bufs (int fd,
+			  enum v4l2_memory memory,
+			  const struct v4l2_format *fmt,
+			  uint32_t *count,
+			  uint32_t *index);
+
 int v4l2_mfc_querybuf (int fd,
 		       int index,
 		       enum v4l2_buf_type type,
@@ -35,9 +47,16 @@ int v4l2_mfc_qbuf (int fd,
 
 int v4l2_mfc_dqbuf (int fd,
 		    struct v4l2_buffer *dqbuf,
+		    struct v4l2_plane *planes,
 		    enum v4l2_buf_type type,
 		    enum v4l2_memory memory);
 
+int v4l2_mfc_expbuf (int fd,
+		     enum v4l2_buf_type type,
+		     int index,
+		     int plane,
+		     int *dmafd);
+
 int v4l2_mfc_g_fmt (int fd,
 		    struct v4l2_format *fmt);
 
@@ -45,7 +64,17 @@ int v4l2_mfc_g_crop (int fd,
 		     struct v4l2_crop *crop,
 		     enum v4l2_buf_type type);
 
+int v4l2_mfc_encoder_cmd (int fd, uint32_t cmd);
+
+/* with try, only ask whether the driver knows cmd */
+int v4l2_mfc_decoder_cmd (int fd, uint32_t cmd, bool try);
+
+int v4l2_mfc_subscribe_event (int fd, uint32_t type);
+
+int v4l2_mfc_dqevent (int fd, struct v4l2_event *ev);
+
 int v4l2_mfc_poll (int fd,
+		   short events,
 		   int *revents,
 		   int timeout);
 
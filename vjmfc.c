@@ -0,0 +1,642 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mfc.h"
+#include "enc.h"
+#include "convert.h"
+#include "dev.h"
+#include "trace.h"
+
+struct vjmfc {
+	struct mfc_ctxt *ctxt;
+	uint8_t *header;
+	bool threaded;
+};
+
+static const enum v4l2_memory memories[] = {
+	[VJMFC_MEMORY_MMAP] = V4L2_MEMORY_MMAP,
+	[VJMFC_MEMORY_USERPTR] = V4L2_MEMORY_USERPTR,
+	[VJMFC_MEMORY_DMABUF] = V4L2_MEMORY_DMABUF,
+};
+
+/* a few seconds of most streams */
+#define DEFAULT_READ_AHEAD_BYTES (16 << 20)
+
+void
+vjmfc_params_init (struct vjmfc_params *params)
+{
+	memset (params, 0, sizeof (*params));
+	params->preset = VJMFC_PRESET_DEFAULT;
+	params->capture_extra = -1;
+	params->input_memory = VJMFC_MEMORY_MMAP;
+}
+
+static bool
+apply_params (struct vjmfc *dec, const struct vjmfc_params *params)
+{
+	struct vjmfc_params defaults;
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	if (!params) {
+		vjmfc_params_init (&defaults);
+		params = &defaults;
+	}
+
+	if (!mfc_ctxt_set_preset (ctxt, params->low_latency ?
+				  VJMFC_PRESET_LATENCY : params->preset))
+		return false;
+
+	if ((unsigned) params->input_memory >=
+	    sizeof (memories) / sizeof (memories[0]))
+		return false;
+
+	if (params->output_buffers > 0)
+		ctxt->in_count = params->output_buffers;
+	if (params->capture_extra >= 0)
+		ctxt->out_extra = params->capture_extra;
+
+	ctxt->in_memory = memories[params->input_memory];
+	ctxt->export_dmabuf = params->export_dmabuf;
+	ctxt->batch = params->batch;
+	ctxt->low_latency = params->low_latency;
+	ctxt->keyframes_only = params->keyframes_only;
+	ctxt->key_interval = params->keyframe_interval;
+	ctxt->adaptive = params->adaptive && !params->low_latency;
+	ctxt->read_ahead = params->read_ahead;
+	ctxt->read_ahead_bytes = params->read_ahead_bytes ?
+		params->read_ahead_bytes : DEFAULT_READ_AHEAD_BYTES;
+	dec->threaded = params->threaded;
+
+	return true;
+}
+
+static struct vjmfc *
+vjmfc_new (const struct vjmfc_params *params)
+{
+	struct vjmfc *dec = calloc (1, sizeof (struct vjmfc));
+	if (!dec)
+		return NULL;
+
+	dec->ctxt = mfc_ctxt_new ();
+	if (!dec->ctxt) {
+		free (dec);
+		return NULL;
+	}
+
+	if (!apply_params (dec, params)) {
+		vjmfc_close (dec);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return dec;
+}
+
+/* keep errno from the failure, not from the teardown */
+static struct vjmfc *
+vjmfc_fail (struct vjmfc *dec)
+{
+	int err = errno ? errno : EIO;
+
+	vjmfc_close (dec);
+	errno = err;
+	return NULL;
+}
+
+struct vjmfc *
+vjmfc_open (const char *filename, const struct vjmfc_params *params)
+{
+	struct vjmfc *dec = vjmfc_new (params);
+	if (!dec)
+		return NULL;
+
+	/* demuxed packets have to be copied into our own buffers */
+	if (dec->ctxt->in_memory == V4L2_MEMORY_DMABUF) {
+		errno = EINVAL;
+		return vjmfc_fail (dec);
+	}
+
+	if (!mfc_ctxt_open (dec->ctxt, filename))
+		return vjmfc_fail (dec);
+
+	if (!mfc_ctxt_init (dec->ctxt))
+		return vjmfc_fail (dec);
+
+	return dec;
+}
+
+struct vjmfc *
+vjmfc_open_codec (uint32_t fourcc,
+		  const void *header,
+		  uint32_t size,
+		  const struct vjmfc_params *params)
+{
+	struct vjmfc *dec = vjmfc_new (params);
+	if (!dec)
+		return NULL;
+
+	if (header && size > 0) {
+		/* with dmabufs the header has to be pushed as one */
+		if (dec->ctxt->in_memory == V4L2_MEMORY_DMABUF) {
+			errno = EINVAL;
+			return vjmfc_fail (dec);
+		}
+
+		dec->header = malloc (size);
+		if (!dec->header)
+			return vjmfc_fail (dec);
+		memcpy (dec->header, header, size);
+	}
+
+	/* avcC configurations turn the packets to Annex-B as they're pushed */
+	if (!mfc_ctxt_set_codec (dec->ctxt, fourcc, dec->header,
+				 dec->header ? size : 0)) {
+		errno = EINVAL;
+		return vjmfc_fail (dec);
+	}
+
+	if (!mfc_ctxt_open_device (dec->ctxt))
+		return vjmfc_fail (dec);
+
+	if (!mfc_ctxt_init (dec->ctxt))
+		return vjmfc_fail (dec);
+
+	return dec;
+}
+
+/* returns the revents, or a negative errno */
+static int
+wait_device (struct mfc_ctxt *ctxt, short events, int timeout)
+{
+	int ret, revents;
+
+	do {
+		ret = v4l2_mfc_poll (ctxt->handler, events, &revents, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+	if (ret == 0)
+		return -EAGAIN;
+	if (revents & POLLERR)
+		return -EIO;
+
+	return revents;
+}
+
+static int
+wait_input (struct mfc_ctxt *ctxt, struct mfc_buffer **b, int timeout)
+{
+	int ret;
+
+	if (ctxt->eos)
+		return -EPIPE;
+
+	while (!(*b = mfc_ctxt_get_input (ctxt))) {
+		if (!mfc_ctxt_dequeue_input (ctxt))
+			return -EIO;
+		if (ctxt->nfree > 0)
+			continue;
+
+		ret = wait_device (ctxt, POLLOUT, timeout);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+queue_input (struct mfc_ctxt *ctxt, struct mfc_buffer *b, int64_t pts)
+{
+	/* an empty buffer ends the stream */
+	if (b->planes[0].bytesused == 0)
+		ctxt->eos = true;
+
+	if (!mfc_ctxt_queue_input (ctxt, b, pts))
+		return -EIO;
+
+	/* the device may have to be watched again */
+	mfc_ctxt_kick (ctxt);
+	return 0;
+}
+
+int
+vjmfc_get_input (struct vjmfc *dec, void **data, uint32_t *size, int timeout)
+{
+	int ret;
+	struct mfc_buffer *b;
+
+	if (dec->ctxt->in_memory == V4L2_MEMORY_DMABUF)
+		return -EINVAL;
+
+	ret = wait_input (dec->ctxt, &b, timeout);
+	if (ret < 0)
+		return ret;
+
+	*data = b->paddr[0];
+	*size = b->planes[0].length;
+
+	return b->buf.index;
+}
+
+int
+vjmfc_push_input (struct vjmfc *dec, int index, uint32_t bytesused, int64_t pts)
+{
+	struct mfc_buffer *b;
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	if (index < 0 || (uint32_t) index >= ctxt->ic)
+		return -EINVAL;
+
+	b = &ctxt->in[index];
+	if (bytesused > b->planes[0].length)
+		return -E2BIG;
+
+	b->planes[0].bytesused = bytesused;
+	return queue_input (ctxt, b, pts);
+}
+
+int
+vjmfc_push_packet (struct vjmfc *dec,
+		   const void *data,
+		   uint32_t size,
+		   int64_t pts,
+		   int timeout)
+{
+	int idx;
+	void *dst;
+	uint32_t len;
+	size_t n;
+
+	if (size > dec->ctxt->in_size)
+		return -E2BIG;
+
+	idx = vjmfc_get_input (dec, &dst, &len, timeout);
+	if (idx < 0)
+		return idx;
+
+	/* without a key flag, no parameter sets get added */
+	n = packetizer_write (&dec->ctxt->pz, dst, len, data, size, false);
+	if (n == 0) {
+		/* back to the free ones, unqueued */
+		dec->ctxt->in_free[dec->ctxt->nfree++] = idx;
+		return -E2BIG;
+	}
+
+	return vjmfc_push_input (dec, idx, n, pts);
+}
+
+int
+vjmfc_push_dmabuf (struct vjmfc *dec,
+		   int fd,
+		   uint32_t length,
+		   uint32_t bytesused,
+		   int64_t pts,
+		   int timeout)
+{
+	int ret;
+	struct mfc_buffer *b;
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	if (ctxt->in_memory != V4L2_MEMORY_DMABUF || bytesused > length)
+		return -EINVAL;
+
+	ret = wait_input (ctxt, &b, timeout);
+	if (ret < 0)
+		return ret;
+
+	b->planes[0].m.fd = fd;
+	b->planes[0].length = length;
+	b->planes[0].bytesused = bytesused;
+
+	return queue_input (ctxt, b, pts);
+}
+
+int
+vjmfc_pull_frame (struct vjmfc *dec, struct vjmfc_frame *frame, int timeout)
+{
+	int ret;
+	short events = POLLIN | POLLPRI;
+	uint32_t idx;
+	struct mfc_ctxt *ctxt = dec->ctxt;
+	bool file = mfc_ctxt_has_file (ctxt);
+
+	/* file-backed decoders read ahead on their own */
+	if (file)
+		events |= POLLOUT;
+
+	for (;;) {
+		if (ctxt->done)
+			return -ENODATA;
+
+		/* nothing to decode before the header is in */
+		if (!ctxt->capture_ready)
+			return -EAGAIN;
+
+		if (file && (!mfc_ctxt_dequeue_input (ctxt) ||
+			     !mfc_ctxt_feed (ctxt)))
+			return -EIO;
+
+		ret = mfc_ctxt_dequeue_frame (ctxt, &idx);
+		if (ret < 0)
+			return -EIO;
+
+		if (ret > 0) {
+			mfc_ctxt_get_frame (ctxt, idx, frame);
+			ctxt->frames++;
+			return 0;
+		}
+
+		if (ctxt->done)
+			return -ENODATA;
+
+		/* the caller has to release frames before the new ones */
+		if (ctxt->resize_drained)
+			return -EAGAIN;
+
+		ret = wait_device (ctxt, events, timeout);
+		if (ret < 0)
+			return ret;
+
+		if (ret & POLLPRI && !mfc_ctxt_handle_events (ctxt))
+			return -EIO;
+	}
+}
+
+int
+vjmfc_release_frame (struct vjmfc *dec, const struct vjmfc_frame *frame)
+{
+	if (frame->index >= dec->ctxt->oc)
+		return -EINVAL;
+
+	if (!mfc_ctxt_queue_frame (dec->ctxt, frame->index))
+		return -EIO;
+
+	mfc_ctxt_kick (dec->ctxt);
+	return 0;
+}
+
+int
+vjmfc_flush (struct vjmfc *dec)
+{
+	int idx;
+	void *data;
+	uint32_t size;
+
+	if (dec->ctxt->eos)
+		return 0;
+
+	/* there is no buffer of ours to send empty */
+	if (dec->ctxt->in_memory == V4L2_MEMORY_DMABUF)
+		return -EINVAL;
+
+	idx = vjmfc_get_input (dec, &data, &size, POLL_TIMEOUT);
+	if (idx < 0)
+		return idx;
+
+	return vjmfc_push_input (dec, idx, 0, 0);
+}
+
+int
+vjmfc_seek (struct vjmfc *dec, int64_t pts)
+{
+	if (!mfc_ctxt_has_file (dec->ctxt))
+		return -EINVAL;
+
+	return mfc_ctxt_seek (dec->ctxt, pts) ? 0 : -EIO;
+}
+
+int
+vjmfc_restart (struct vjmfc *dec, const char *filename)
+{
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	/* the rest of the old stream is dropped, not handed out */
+	if (!mfc_ctxt_has_file (ctxt) || ctxt->async_fd != -1)
+		return -EINVAL;
+
+	ctxt->frame_cb = NULL;
+	return mfc_ctxt_restart (ctxt, filename) ? 0 : -EIO;
+}
+
+int
+vjmfc_set_async (struct vjmfc *dec, const struct vjmfc_callbacks *callbacks)
+{
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	if (dec->threaded || ctxt->async_fd != -1)
+		return -EINVAL;
+
+	if (!mfc_ctxt_async_init (ctxt, callbacks)) {
+		mfc_ctxt_async_close (ctxt);
+		return -EIO;
+	}
+
+	return ctxt->async_fd;
+}
+
+int
+vjmfc_dispatch (struct vjmfc *dec)
+{
+	if (dec->ctxt->async_fd == -1)
+		return -EINVAL;
+
+	return mfc_ctxt_dispatch (dec->ctxt) ? 0 : -EIO;
+}
+
+int
+vjmfc_decode (struct vjmfc *dec, vjmfc_frame_cb cb, void *data)
+{
+	bool ok;
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	if (!mfc_ctxt_has_file (ctxt))
+		return -EINVAL;
+
+	ctxt->frame_cb = cb;
+	ctxt->frame_data = data;
+
+	if (dec->threaded)
+		ok = mfc_ctxt_decode_threaded (ctxt);
+	else
+		ok = mfc_ctxt_decode (ctxt);
+
+	return ok ? 0 : -EIO;
+}
+
+int
+vjmfc_decode_many (struct vjmfc **decs,
+		   unsigned int n,
+		   vjmfc_frame_cb cb,
+		   void **data)
+{
+	bool ok;
+	unsigned int i;
+	struct mfc_ctxt **ctxts;
+
+	ctxts = calloc (n, sizeof (struct mfc_ctxt *));
+	if (!ctxts)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		if (!mfc_ctxt_has_file (decs[i]->ctxt)) {
+			free (ctxts);
+			return -EINVAL;
+		}
+
+		ctxts[i] = decs[i]->ctxt;
+		ctxts[i]->frame_cb = cb;
+		ctxts[i]->frame_data = data ? data[i] : NULL;
+	}
+
+	ok = mfc_ctxt_decode_many (ctxts, n);
+	free (ctxts);
+
+	return ok ? 0 : -EIO;
+}
+
+int
+vjmfc_convert_frame (const struct vjmfc_frame *frame,
+		     const struct vjmfc_image *image,
+		     unsigned int threads)
+{
+	return convert_frame (frame, image, threads);
+}
+
+void
+vjmfc_enc_params_init (struct vjmfc_enc_params *params)
+{
+	memset (params, 0, sizeof (*params));
+	params->fourcc = V4L2_PIX_FMT_H264;
+	params->profile = -1;
+}
+
+int
+vjmfc_transcode (struct vjmfc *dec,
+		 const char *filename,
+		 const struct vjmfc_enc_params *params)
+{
+	int fd, err = 0;
+	struct mfc_enc enc;
+	struct vjmfc_enc_params defaults;
+	struct mfc_ctxt *ctxt = dec->ctxt;
+
+	if (!mfc_ctxt_has_file (ctxt) || !ctxt->export_dmabuf)
+		return -EINVAL;
+
+	/* the encoder is set up for the first resolution */
+	if (!ctxt->capture_ready)
+		return -EINVAL;
+
+	/* the encoder has one slot per frame buffer there is now */
+	ctxt->adaptive = false;
+
+	if (!params) {
+		vjmfc_enc_params_init (&defaults);
+		params = &defaults;
+	}
+
+	fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (!mfc_enc_open (&enc, params, ctxt, fd) ||
+	    !mfc_enc_transcode (&enc, ctxt))
+		err = -EIO;
+
+	mfc_enc_close (&enc);
+	close (fd);
+
+	return err;
+}
+
+void
+vjmfc_get_stats (struct vjmfc *dec, struct vjmfc_stats *stats)
+{
+	struct mfc_ctxt *ctxt = dec->ctxt;
+	double n = ctxt->depth_samples ? ctxt->depth_samples : 1;
+
+	stats->fourcc = ctxt->codec;
+	stats->width = ctxt->fmt.fmt.pix_mp.width;
+	stats->height = ctxt->fmt.fmt.pix_mp.height;
+	stats->frames = ctxt->frames;
+	stats->output_depth = ctxt->in_depth / n;
+	stats->capture_depth = ctxt->out_depth / n;
+	stats->capture_buffers = ctxt->oc;
+	stats->saturation = ctxt->saturated / n;
+	stats->read_stalls = ctxt->prefetch.stalls;
+	stats->device = (ctxt->handler != -1) ?
+		v4l2_device_path (ctxt->node) : NULL;
+}
+
+/* ms between two stamps, 0 when either is missing */
+static double
+span (uint64_t from, uint64_t to)
+{
+	return (from && to > from) ? (to - from) / 1e6 : 0.0;
+}
+
+void
+vjmfc_get_startup (struct vjmfc *dec, struct vjmfc_startup *startup)
+{
+	const struct mfc_startup *s = &dec->ctxt->startup;
+
+	startup->probe = span (s->start, s->probed);
+	startup->stream_info = span (s->probed, s->info);
+	startup->device = s->device / 1e6;
+	startup->buffers = s->buffers / 1e6;
+	startup->header = span (s->init, s->parsed);
+	startup->capture = span (s->parsed, s->capture);
+	startup->first_frame = span (s->start, s->first);
+}
+
+int
+vjmfc_export_counters (const char *name)
+{
+	return counters_export (name);
+}
+
+void
+vjmfc_get_counters (struct vjmfc *dec, struct vjmfc_counters *counters)
+{
+	counters_read (dec->ctxt->cnt, counters);
+}
+
+void
+vjmfc_read_counters (const struct vjmfc_counters *slot,
+		     struct vjmfc_counters *counters)
+{
+	counters_read (slot, counters);
+}
+
+int
+vjmfc_prewarm (unsigned int handles)
+{
+	int n = v4l2_prewarm (MFC_DEC_DRIVER, handles);
+
+	return (n < 0) ? -errno : n;
+}
+
+int
+vjmfc_trace_dump (const char *filename)
+{
+	return trace_dump (filename);
+}
+
+void
+vjmfc_close (struct vjmfc *dec)
+{
+	if (!dec)
+		return;
+
+	mfc_ctxt_deinit (dec->ctxt);
+	mfc_ctxt_close (dec->ctxt);
+	mfc_ctxt_free (dec->ctxt);
+	free (dec->header);
+	free (dec);
+}
@@ -0,0 +1,380 @@
+#ifndef VJMFC_H_
+#define VJMFC_H_
+
+/*
+ * libvjmfc: video decoding on the Samsung MFC through V4L2.
+ *
+ * A decoder is either backed by a file, in which case the library
+ * demuxes it and vjmfc_decode () runs the whole pipeline, or by a bare
+ * codec, in which case the caller pushes compressed packets and pulls
+ * decoded frames.
+ *
+ * Unless noted otherwise, functions returning int give 0 on success
+ * and a negative errno value on failure. -EAGAIN means the call would
+ * have to wait longer than the given timeout (in ms, -1 is forever).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VJMFC_EXPORT __attribute__ ((visibility ("default")))
+
+struct vjmfc;
+
+enum vjmfc_preset {
+	VJMFC_PRESET_DEFAULT,
+	VJMFC_PRESET_LATENCY,
+	VJMFC_PRESET_THROUGHPUT,
+};
+
+/* how compressed (OUTPUT) buffers are backed */
+enum vjmfc_memory {
+	VJMFC_MEMORY_MMAP,	/* driver memory */
+	VJMFC_MEMORY_USERPTR,	/* page-aligned pool owned by the decoder */
+	VJMFC_MEMORY_DMABUF,	/* dmabufs pushed by the caller */
+};
+
+struct vjmfc_params {
+	enum vjmfc_preset preset;
+	uint32_t output_buffers;	/* 0 keeps the preset's */
+	int capture_extra;		/* negative keeps the preset's */
+	enum vjmfc_memory input_memory;
+	bool export_dmabuf;		/* hand out dmabufs, don't mmap frames */
+	bool threaded;			/* vjmfc_decode () with two threads */
+	/*
+	 * Several frames per input buffer. They all get the pts and
+	 * queueing time of the buffer's first one, so frame pts and
+	 * latency are per buffer, not per frame.
+	 */
+	bool batch;
+	/*
+	 * Frames in decode order with no display delay, and the latency
+	 * preset's queue depths unless counts are given.
+	 */
+	bool low_latency;
+	/*
+	 * File-backed decoders only: decode nothing but the keyframes, at
+	 * most one per keyframe_interval seconds (0 for all of them). Raw
+	 * streams have no timing and get every keyframe.
+	 */
+	bool keyframes_only;
+	double keyframe_interval;
+	/*
+	 * Add frame buffers while the caller holds too many of them for
+	 * the driver to keep decoding. Off with low_latency, and where the
+	 * driver can't add buffers to a running queue.
+	 */
+	bool adaptive;
+	/*
+	 * Demux up to read_ahead packets, and read_ahead_bytes (0 for
+	 * 16 MiB), from a thread of their own. 0 reads as they're queued.
+	 */
+	uint32_t read_ahead;
+	size_t read_ahead_bytes;
+};
+
+/*
+ * A decoded frame. Planes are either mapped (plane) or exported
+ * (dmabuf, -1 otherwise). The dmabufs stay the same for a given index
+ * until the resolution changes (width and height do), so importers can
+ * cache them.
+ */
+struct vjmfc_frame {
+	uint32_t index;
+	uint32_t fourcc;		/* V4L2_PIX_FMT_NV12M or NV12MT */
+	uint32_t width, height;
+	uint32_t num_planes;
+	void *plane[2];
+	int dmabuf[2];
+	uint32_t bytesused[2];
+	int64_t pts;		/* per buffer when batching */
+	uint64_t latency;	/* ns from queueing the packet to now */
+};
+
+struct vjmfc_stats {
+	uint32_t fourcc;		/* compressed format */
+	uint32_t width, height;		/* 0 until the header is decoded */
+	uint64_t frames;
+	double output_depth;	/* average compressed buffers in the driver */
+	double capture_depth;	/* average frame buffers in the driver */
+	uint32_t capture_buffers;	/* frame buffers, adaptive ones included */
+	/*
+	 * Share of frames decoded with every packet in the driver and
+	 * frames to spare: the hardware, not the reading, sets the pace.
+	 */
+	double saturation;
+	uint64_t read_stalls;	/* times the read-ahead had no packet ready */
+	/*
+	 * The decoder node the stream was placed on: the least loaded one
+	 * when the driver has several.
+	 */
+	const char *device;
+};
+
+/*
+ * Where the time to the first frame went, in ms; 0 for steps that
+ * didn't happen. Stream info, device and buffers run side by side.
+ */
+struct vjmfc_startup {
+	double probe;		/* opening the container, its header */
+	double stream_info;	/* libavformat probing the streams */
+	double device;		/* finding, opening and querying the node */
+	double buffers;		/* OUTPUT format and buffers */
+	double header;		/* from decoder setup to the header parsed */
+	double capture;		/* CAPTURE format and buffers */
+	double first_frame;	/* from opening to the first frame */
+};
+
+/*
+ * Live counters of one decoder, updated without locks while it runs.
+ * After vjmfc_export_counters () they live in a shared memory object
+ * (/dev/shm/NAME) that other processes may map read-only: a
+ * struct vjmfc_counters_header, then slots blocks of slot_size bytes.
+ * Copy a slot out with vjmfc_read_counters (); it belongs to a decoder
+ * while in_use is 1, and generation changes every time it's taken.
+ */
+#define VJMFC_COUNTERS_MAGIC 0x434d4a56	/* "VJMC" */
+#define VJMFC_COUNTERS_VERSION 1
+
+struct vjmfc_counters_header {
+	uint32_t magic, version;
+	uint32_t slots, slot_size;
+	uint32_t pid;
+};
+
+struct vjmfc_counters {
+	uint32_t in_use;
+	uint32_t generation;
+	uint32_t fourcc;		/* compressed format */
+	uint32_t width, height;
+	uint32_t output_queued;		/* compressed buffers in the driver */
+	uint32_t capture_queued;	/* frame buffers in the driver */
+	uint32_t capture_buffers;
+	uint64_t opened, updated;	/* ns, CLOCK_MONOTONIC; fps from these */
+	uint64_t packets, bytes;	/* compressed, queued */
+	uint64_t frames;		/* decoded */
+	/* packets that couldn't be queued, frames skipped after a seek */
+	uint64_t dropped;
+	uint64_t eagain;		/* frame dequeues that found nothing */
+	uint64_t epipe;			/* dequeues after the last buffer */
+	uint64_t errors;		/* buffer ioctls that failed otherwise */
+	uint64_t mapped;		/* bytes of buffers mapped */
+	uint64_t resolution_changes;
+};
+
+enum vjmfc_pixfmt {
+	VJMFC_PIXFMT_NV12,	/* Y plane, interleaved UV plane */
+	VJMFC_PIXFMT_I420,	/* Y, U and V planes */
+	VJMFC_PIXFMT_RGB24,	/* one plane of R, G, B bytes, BT.601 */
+};
+
+/* CPU memory to convert frames into, strides in bytes */
+struct vjmfc_image {
+	enum vjmfc_pixfmt format;
+	uint8_t *plane[3];
+	uint32_t stride[3];
+};
+
+/* what vjmfc_transcode () encodes to; zeros keep the driver's */
+struct vjmfc_enc_params {
+	uint32_t fourcc;	/* V4L2_PIX_FMT_H264 (default), MPEG4 or H263 */
+	uint32_t bitrate;	/* bits per second, with rate control */
+	uint32_t gop;		/* frames from one keyframe to the next */
+	int profile;		/* V4L2_MPEG_VIDEO_*_PROFILE_*, -1 for the default */
+};
+
+/* the frame is only valid until the callback returns */
+typedef void (*vjmfc_frame_cb) (const struct vjmfc_frame *frame, void *data);
+
+/*
+ * Asynchronous mode, see vjmfc_set_async (). Every callback may be
+ * NULL; frames then go straight back to the decoder.
+ */
+struct vjmfc_callbacks {
+	/* vjmfc_get_input () with a timeout of 0 would succeed */
+	void (*input_free) (void *data);
+	/* the frame is the caller's until vjmfc_release_frame () */
+	vjmfc_frame_cb frame_ready;
+	/* the last frame has been handed out */
+	void (*drained) (void *data);
+	void *data;
+};
+
+VJMFC_EXPORT void vjmfc_params_init (struct vjmfc_params *params);
+
+/* params may be NULL for the defaults */
+VJMFC_EXPORT struct vjmfc *vjmfc_open (const char *filename,
+				       const struct vjmfc_params *params);
+
+/*
+ * fourcc is a V4L2_PIX_FMT_* compressed format. header is the codec
+ * configuration (or the first packet when the stream carries it in
+ * band); with NULL the first pushed packet is taken as the header.
+ */
+VJMFC_EXPORT struct vjmfc *vjmfc_open_codec (uint32_t fourcc,
+					     const void *header,
+					     uint32_t size,
+					     const struct vjmfc_params *params);
+
+/* copy a packet into a free input buffer and queue it */
+VJMFC_EXPORT int vjmfc_push_packet (struct vjmfc *dec,
+				    const void *data,
+				    uint32_t size,
+				    int64_t pts,
+				    int timeout);
+
+/*
+ * Zero-copy variant: borrow a free input buffer, write the packet into
+ * it and queue it with vjmfc_push_input (). Returns the buffer index.
+ */
+VJMFC_EXPORT int vjmfc_get_input (struct vjmfc *dec,
+				  void **data,
+				  uint32_t *size,
+				  int timeout);
+
+VJMFC_EXPORT int vjmfc_push_input (struct vjmfc *dec,
+				   int index,
+				   uint32_t bytesused,
+				   int64_t pts);
+
+/* VJMFC_MEMORY_DMABUF only; a bytesused of 0 ends the stream */
+VJMFC_EXPORT int vjmfc_push_dmabuf (struct vjmfc *dec,
+				    int fd,
+				    uint32_t length,
+				    uint32_t bytesused,
+				    int64_t pts,
+				    int timeout);
+
+/*
+ * Get the next decoded frame; it belongs to the caller until
+ * vjmfc_release_frame (). Returns -ENODATA once the stream is drained,
+ * and -EAGAIN at a resolution change until every frame is released.
+ * File-backed decoders are fed from their file meanwhile.
+ */
+VJMFC_EXPORT int vjmfc_pull_frame (struct vjmfc *dec,
+				   struct vjmfc_frame *frame,
+				   int timeout);
+
+VJMFC_EXPORT int vjmfc_release_frame (struct vjmfc *dec,
+				      const struct vjmfc_frame *frame);
+
+/* no more input: the remaining frames can still be pulled */
+VJMFC_EXPORT int vjmfc_flush (struct vjmfc *dec);
+
+/*
+ * File-backed decoders only: jump to pts (in the units of frame pts,
+ * frame numbers for raw streams). Decoding restarts at the keyframe
+ * before it, and the frames up to pts are not returned. Frames held by
+ * the caller stay valid. Not while vjmfc_decode () runs.
+ */
+VJMFC_EXPORT int vjmfc_seek (struct vjmfc *dec, int64_t pts);
+
+/*
+ * File-backed decoders only: go on with another file of the same codec
+ * (the next segment, or playlist entry) on the same device and buffers.
+ * Whatever is left of the current file is drained and dropped. The new
+ * file is decoded by vjmfc_decode () or vjmfc_pull_frame () as usual.
+ * Not while vjmfc_decode () runs, nor in asynchronous mode.
+ */
+VJMFC_EXPORT int vjmfc_restart (struct vjmfc *dec, const char *filename);
+
+/*
+ * Switch the decoder to asynchronous mode for an external event loop.
+ * Returns a file descriptor to watch for reading (poll, epoll); it
+ * covers the device and everything the caller does to the decoder.
+ * Whenever it is readable call vjmfc_dispatch (), which never blocks
+ * and reports through the callbacks. Push and release as usual, with
+ * a timeout of 0. File-backed decoders are fed from dispatch. The fd
+ * belongs to the decoder. vjmfc_decode () and pull_frame () don't mix
+ * with it.
+ */
+VJMFC_EXPORT int vjmfc_set_async (struct vjmfc *dec,
+				  const struct vjmfc_callbacks *callbacks);
+
+VJMFC_EXPORT int vjmfc_dispatch (struct vjmfc *dec);
+
+/* file-backed decoders only: decode everything, calling cb per frame */
+VJMFC_EXPORT int vjmfc_decode (struct vjmfc *dec,
+			       vjmfc_frame_cb cb,
+			       void *data);
+
+/*
+ * Decode n file-backed decoders at once from a single thread. Frames
+ * of decs[i] go to cb with data[i] (data may be NULL). Fails if any of
+ * the streams does, but the others are still decoded to the end.
+ */
+VJMFC_EXPORT int vjmfc_decode_many (struct vjmfc **decs,
+				    unsigned int n,
+				    vjmfc_frame_cb cb,
+				    void **data);
+
+/*
+ * Convert a mapped frame, tiled (NV12MT) or not (NV12M), to a linear
+ * image of frame->width x frame->height. Stripes of the frame are
+ * converted by up to threads threads; 0 only splits frames of 1080
+ * lines or more, over the online CPUs. -EINVAL for exported frames.
+ */
+VJMFC_EXPORT int vjmfc_convert_frame (const struct vjmfc_frame *frame,
+				      const struct vjmfc_image *image,
+				      unsigned int threads);
+
+VJMFC_EXPORT void vjmfc_enc_params_init (struct vjmfc_enc_params *params);
+
+/*
+ * File-backed decoders opened with export_dmabuf only: re-encode the
+ * whole file on the MFC encoder into filename, as an elementary
+ * stream. The encoder reads the decoded frames in place. params may be
+ * NULL for the defaults.
+ */
+VJMFC_EXPORT int vjmfc_transcode (struct vjmfc *dec,
+				  const char *filename,
+				  const struct vjmfc_enc_params *params);
+
+VJMFC_EXPORT void vjmfc_get_stats (struct vjmfc *dec,
+				   struct vjmfc_stats *stats);
+
+VJMFC_EXPORT void vjmfc_get_startup (struct vjmfc *dec,
+				     struct vjmfc_startup *startup);
+
+/*
+ * Put the counters of the decoders opened from now on in the shared
+ * memory object name ("/vjmfc.PID", say). Once per process; the object
+ * outlives it unless shm_unlink () is called.
+ */
+VJMFC_EXPORT int vjmfc_export_counters (const char *name);
+
+/* a snapshot of the decoder's counters, exported or not */
+VJMFC_EXPORT void vjmfc_get_counters (struct vjmfc *dec,
+				      struct vjmfc_counters *counters);
+
+/* the same, from a slot of a mapped object; no torn values */
+VJMFC_EXPORT void vjmfc_read_counters (const struct vjmfc_counters *slot,
+				       struct vjmfc_counters *counters);
+
+/*
+ * Keep this many decoder handles opened and queried ahead of time, so
+ * vjmfc_open* () skip that; closing a decoder tops the pool up again.
+ * Each handle takes one of the MFC's instances (16 at most), 0 gives
+ * them back. Returns how many are warm.
+ */
+VJMFC_EXPORT int vjmfc_prewarm (unsigned int handles);
+
+/*
+ * Write the ioctls traced so far, from every thread, as Chrome trace
+ * JSON (chrome://tracing, Perfetto). -ENOSYS unless the library was
+ * built with tracing.
+ */
+VJMFC_EXPORT int vjmfc_trace_dump (const char *filename);
+
+/* stops the stream where it is: no frame callback runs after this */
+VJMFC_EXPORT void vjmfc_close (struct vjmfc *dec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif